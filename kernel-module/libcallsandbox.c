@@ -1,4 +1,3 @@
-
 // SPDX-License-Identifier: MIT
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -6,28 +5,46 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/hashtable.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/pid.h>
 #include <linux/sched.h>
 #include <linux/signal.h>
+#include <linux/spinlock.h>
 #include <linux/kprobes.h>
+#include <linux/ktime.h>
+#include <linux/bitmap.h>
+#include <linux/moduleparam.h>
+#include <linux/llist.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 
 #define DEVICE_NAME "libcallsandbox"
 
-MODULE_LICENSE("MIT");
+MODULE_LICENSE("Dual MIT/GPL"); // kprobes and pid lookups are GPL-only exports
 MODULE_AUTHOR("Your Team");
 MODULE_DESCRIPTION("In-kernel per-process libcalls sandbox enforcing dummy() automata");
-MODULE_VERSION("1.0");
+MODULE_VERSION("1.1");
 
 // ---------------------- Policy format (compact NFA) ----------------------
 
+#define ID_MODE_DUMMY  0
+#define ID_MODE_UNIQUE 1
+#define ID_MODE_GLOBAL 2 // 64-bit event = func_key << 32 | site index
+#define ID_MODE_CHECKPOINT 3
+
+#define MAX_FUNCS (1u << 20)
+#define MAX_CHECKPOINTS 8192 // reach matrix is MAX_CHECKPOINTS^2 bits
+
 struct edge {
   u32 src;
   u32 dst;
-  s32 match_id;    // id to match: either dummyID or uniqueID depending on id_mode
+  s32 match_id;    // id to match: dummyID, uniqueID or site index depending on id_mode
   u8  is_epsilon;  // 1 if epsilon
-};
+} __packed;        // matches sandboxctl's layout
 
 struct policy_blob {
   u32 pid;
@@ -38,23 +55,100 @@ struct policy_blob {
   // Start set assumed: all nodes with in-degree==0 (simple heuristic)
 };
 
+// One function of a global-ID program. Loading several of these for the same
+// pid builds a hash table keyed by func_key, so any event dispatches in O(1).
+struct policy_blob_v2 {
+  u32 pid;
+  u32 num_nodes;
+  u32 num_edges;
+  u32 id_mode;     // ID_MODE_GLOBAL
+  u32 func_key;    // high 32 bits of the events this automaton consumes
+  u32 reserved;
+  // Followed by num_edges * struct edge (match_id = site index)
+};
+
+// Checkpoint policy (-libcall-checkpoints): checkpoints have IDs 1..n and
+// each event only has to be a permitted successor of the previous one.
+#define CHECKPOINT_GLOBAL 0x1 // func_key is valid; events carry it in the high bits
+
+struct checkpoint_blob {
+  u32 pid;
+  u32 num_checkpoints;
+  u32 func_key;
+  u32 flags;
+  // Followed by (num_checkpoints + 1) rows of DIV_ROUND_UP(num_checkpoints, 64)
+  // u64 words: row 0 is the start set, row i the successors of checkpoint i.
+};
+
 struct frontier {
   u32 num_nodes;
   unsigned long *bitmap; // bitset of active states
 };
 
-struct proc_policy {
-  u32 pid;
+// One function's NFA and its current frontier, or its checkpoint relation
+struct automaton {
   u32 num_nodes;
   u32 num_edges;
-  u32 id_mode;
   struct edge *edges; // array
   struct frontier fr;
+  unsigned long *next; // scratch frontier, so events never allocate
+
+  u32 num_checkpoints; // non-zero: checkpoint policy, the fields above are unused
+  u32 row_words;
+  u64 *reach;          // (num_checkpoints + 1) * row_words
+  u32 last;            // previous checkpoint ID, 0 before the first event
+};
+
+// Event latencies go into 4 log-linear buckets per power of two of ns, so a
+// percentile read from the histogram is within 25% of the true value
+#define LAT_BUCKETS 128
+
+static bool timing = true;
+module_param(timing, bool, 0644);
+MODULE_PARM_DESC(timing, "Time every event for the latency counters (two clock reads per event)");
+
+struct func_slot {
+  u32 key;
+  struct automaton *a; // NULL = empty slot
+};
+
+struct proc_policy {
+  u32 pid;
+  u32 id_mode;
+  u64 start_time;  // of the task that owns pid; a recycled pid starts later
+  // Global IDs: open addressing on the function key, at most half full.
+  // Other modes: a single slot holding the process automaton.
+  u32 num_slots;
+  u32 num_funcs;
+  struct func_slot *slots;
   struct hlist_node hnode;
+
+  // Counters, updated under tbl_lock by the event handler
+  u64 loaded_ns;   // ktime_get_ns() when the pid got this policy
+  u64 events;
+  u64 total_ns;    // time spent stepping automata (timing only)
+  u64 max_ns;
+  u64 violations;
+  u64 lat_hist[LAT_BUCKETS];
 };
 
 DEFINE_HASHTABLE(proc_tbl, 8); // 256 buckets
-static DEFINE_MUTEX(tbl_lock);
+// tbl_lock is taken from the kprobe handler (atomic context) and only guards
+// the table and frontiers; load_lock serializes loaders so they can allocate
+// with GFP_KERNEL before taking tbl_lock.
+static DEFINE_SPINLOCK(tbl_lock);
+static DEFINE_MUTEX(load_lock);
+
+// Histogram bucket of an event that took `ns`
+static u32 lat_bucket(u64 ns)
+{
+  u32 o;
+
+  if (ns < 4) return ns;
+  o = ilog2(ns);
+  if (o > LAT_BUCKETS / 4) return LAT_BUCKETS - 1;
+  return (o - 1) * 4 + ((ns >> (o - 2)) & 3);
+}
 
 // Allocate and zero a frontier
 static int frontier_init(struct frontier *fr, u32 n)
@@ -88,45 +182,42 @@ static void frontier_clear_all(struct frontier *fr)
 }
 
 // Compute epsilon-closure: repeatedly add dst for every epsilon edge from active states
-static void epsilon_closure(struct proc_policy *pp)
+static void epsilon_closure(struct automaton *a)
 {
   bool changed;
   do {
     changed = false;
-    for (u32 i = 0; i < pp->num_edges; ++i) {
-      struct edge *e = &pp->edges[i];
+    for (u32 i = 0; i < a->num_edges; ++i) {
+      struct edge *e = &a->edges[i];
       if (!e->is_epsilon)
         continue;
-      if (frontier_test(&pp->fr, e->src) && !frontier_test(&pp->fr, e->dst)) {
-        frontier_set(&pp->fr, e->dst);
+      if (frontier_test(&a->fr, e->src) && !frontier_test(&a->fr, e->dst)) {
+        frontier_set(&a->fr, e->dst);
         changed = true;
       }
     }
   } while (changed);
 }
 
-// Advance on an observed id (dummy/unique)
-static void advance_frontier(struct proc_policy *pp, s32 observed)
+// Advance on an observed id (dummy/unique/site index)
+static void advance_frontier(struct automaton *a, s32 observed)
 {
-  // new frontier
-  unsigned long *next = kcalloc(BITS_TO_LONGS(pp->fr.num_nodes), sizeof(unsigned long), GFP_ATOMIC);
-  if (!next) return;
+  bitmap_zero(a->next, a->fr.num_nodes);
 
-  for (u32 i = 0; i < pp->num_edges; ++i) {
-    struct edge *e = &pp->edges[i];
+  for (u32 i = 0; i < a->num_edges; ++i) {
+    struct edge *e = &a->edges[i];
     if (e->is_epsilon) continue;
     if (e->match_id != observed) continue;
-    if (frontier_test(&pp->fr, e->src)) {
-      __set_bit(e->dst, next);
+    if (frontier_test(&a->fr, e->src)) {
+      __set_bit(e->dst, a->next);
     }
   }
 
   // replace frontier
-  memcpy(pp->fr.bitmap, next, BITS_TO_LONGS(pp->fr.num_nodes) * sizeof(unsigned long));
-  kfree(next);
+  bitmap_copy(a->fr.bitmap, a->next, a->fr.num_nodes);
 
   // epsilon closure after move
-  epsilon_closure(pp);
+  epsilon_closure(a);
 }
 
 static bool frontier_empty(struct frontier *fr)
@@ -137,6 +228,160 @@ static bool frontier_empty(struct frontier *fr)
   return true;
 }
 
+static void automaton_free(struct automaton *a)
+{
+  if (!a) return;
+  kfree(a->edges);
+  kfree(a->next);
+  kvfree(a->reach);
+  frontier_free(&a->fr);
+  kfree(a);
+}
+
+// Copy the reach matrix from user space. Sleeps; call without tbl_lock held.
+static struct automaton *checkpoints_load(const void __user *urows, u32 num_checkpoints)
+{
+  struct automaton *a;
+  size_t rows_sz;
+
+  if (num_checkpoints == 0 || num_checkpoints > MAX_CHECKPOINTS)
+    return ERR_PTR(-EINVAL);
+
+  a = kzalloc(sizeof(*a), GFP_KERNEL);
+  if (!a) return ERR_PTR(-ENOMEM);
+  a->num_checkpoints = num_checkpoints;
+  a->row_words = DIV_ROUND_UP(num_checkpoints, 64);
+  rows_sz = (size_t)(num_checkpoints + 1) * a->row_words * sizeof(u64);
+  a->reach = kvmalloc(rows_sz, GFP_KERNEL);
+  if (!a->reach) { kfree(a); return ERR_PTR(-ENOMEM); }
+  if (copy_from_user(a->reach, urows, rows_sz)) {
+    automaton_free(a);
+    return ERR_PTR(-EFAULT);
+  }
+  return a;
+}
+
+// O(1): is checkpoint `id` a permitted successor of the previous one?
+static bool checkpoint_step(struct automaton *a, u32 id)
+{
+  const u64 *row;
+
+  if (id == 0 || id > a->num_checkpoints)
+    return false;
+  row = a->reach + (size_t)a->last * a->row_words;
+  if (!(row[(id - 1) / 64] & (1ull << ((id - 1) % 64))))
+    return false;
+  a->last = id;
+  return true;
+}
+
+// Feed one event; false on a policy violation
+static bool automaton_step(struct automaton *a, s32 id)
+{
+  if (a->num_checkpoints)
+    return checkpoint_step(a, (u32)id);
+  advance_frontier(a, id);
+  return !frontier_empty(&a->fr);
+}
+
+// Copy edges from user space and set up the start frontier. Sleeps; call
+// without tbl_lock held.
+static struct automaton *automaton_load(const void __user *uedges, u32 num_nodes, u32 num_edges)
+{
+  struct automaton *a;
+
+  if (num_nodes == 0 || num_edges > (1u<<20)) // sanity
+    return ERR_PTR(-EINVAL);
+
+  a = kzalloc(sizeof(*a), GFP_KERNEL);
+  if (!a) return ERR_PTR(-ENOMEM);
+  a->num_nodes = num_nodes;
+  a->num_edges = num_edges;
+  a->edges = kcalloc(num_edges, sizeof(struct edge), GFP_KERNEL);
+  a->next = kcalloc(BITS_TO_LONGS(num_nodes), sizeof(unsigned long), GFP_KERNEL);
+  if (!a->edges || !a->next || frontier_init(&a->fr, num_nodes)) {
+    automaton_free(a);
+    return ERR_PTR(-ENOMEM);
+  }
+  if (copy_from_user(a->edges, uedges, num_edges * sizeof(struct edge))) {
+    automaton_free(a);
+    return ERR_PTR(-EFAULT);
+  }
+  for (u32 i = 0; i < num_edges; ++i) {
+    if (a->edges[i].src >= num_nodes || a->edges[i].dst >= num_nodes) {
+      automaton_free(a);
+      return ERR_PTR(-EINVAL);
+    }
+  }
+
+  // Initialize start set: nodes with in-degree 0
+  {
+    u32 *indeg = kcalloc(num_nodes, sizeof(u32), GFP_KERNEL);
+    if (indeg) {
+      for (u32 i = 0; i < num_edges; ++i) {
+        if (!a->edges[i].is_epsilon) // count only consuming edges for start heuristic
+          indeg[a->edges[i].dst]++;
+      }
+      for (u32 n = 0; n < num_nodes; ++n) {
+        if (indeg[n] == 0) frontier_set(&a->fr, n);
+      }
+      kfree(indeg);
+    } else {
+      // fallback: start at node 0
+      frontier_set(&a->fr, 0);
+    }
+    epsilon_closure(a);
+  }
+  return a;
+}
+
+static void proc_policy_free(struct proc_policy *pp)
+{
+  if (!pp) return;
+  for (u32 i = 0; i < pp->num_slots; ++i)
+    automaton_free(pp->slots[i].a);
+  kfree(pp->slots);
+  kfree(pp);
+}
+
+// Slot holding `key`, or the empty slot where it would go. num_slots is a
+// power of two and the table is never full.
+static struct func_slot *slot_for(struct func_slot *slots, u32 num_slots, u32 key)
+{
+  u32 i = hash_32(key, ilog2(num_slots));
+  while (slots[i].a && slots[i].key != key)
+    i = (i + 1) & (num_slots - 1);
+  return &slots[i];
+}
+
+// Copy of a freshly loaded automaton (start frontier included) for another pid
+static struct automaton *automaton_clone(const struct automaton *src)
+{
+  struct automaton *a = kmemdup(src, sizeof(*src), GFP_KERNEL);
+  size_t words = BITS_TO_LONGS(src->num_nodes);
+
+  if (!a) return NULL;
+  a->edges = NULL;
+  a->next = NULL;
+  a->fr.bitmap = NULL;
+  a->reach = NULL;
+  if (src->num_checkpoints) {
+    size_t rows_sz = (size_t)(src->num_checkpoints + 1) * src->row_words * sizeof(u64);
+    a->reach = kvmalloc(rows_sz, GFP_KERNEL);
+    if (!a->reach) { automaton_free(a); return NULL; }
+    memcpy(a->reach, src->reach, rows_sz);
+    return a;
+  }
+  a->edges = kmemdup(src->edges, (size_t)src->num_edges * sizeof(struct edge), GFP_KERNEL);
+  a->next = kcalloc(words, sizeof(unsigned long), GFP_KERNEL);
+  a->fr.bitmap = kmemdup(src->fr.bitmap, words * sizeof(unsigned long), GFP_KERNEL);
+  if (!a->edges || !a->next || !a->fr.bitmap) {
+    automaton_free(a);
+    return NULL;
+  }
+  return a;
+}
+
 // ---------------------- Policy table helpers ----------------------
 
 static struct proc_policy *lookup_ppid(u32 pid)
@@ -148,73 +393,537 @@ static struct proc_policy *lookup_ppid(u32 pid)
   return NULL;
 }
 
+// Start time of the live task `pid` names, or 0 if it has none or is exiting
+static u64 task_start_time(u32 pid)
+{
+  struct task_struct *t;
+  u64 start = 0;
+
+  rcu_read_lock();
+  t = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+  if (t && !(t->flags & PF_EXITING)) start = t->start_time;
+  rcu_read_unlock();
+  return start;
+}
+
+// Remove pid's policy, if it belongs to the task started at `start_time`
+// (0 = any), and return it for the caller to free.
+static struct proc_policy *unlink_policy(u32 pid, u64 start_time)
+{
+  struct proc_policy *pp;
+  unsigned long flags;
+
+  mutex_lock(&load_lock);
+  pp = lookup_ppid(pid);
+  if (pp && start_time && pp->start_time != start_time) pp = NULL;
+  if (pp) {
+    spin_lock_irqsave(&tbl_lock, flags);
+    hash_del(&pp->hnode);
+    spin_unlock_irqrestore(&tbl_lock, flags);
+  }
+  mutex_unlock(&load_lock);
+  return pp;
+}
+
+// Policies of exited tasks. The exit and event probes run in atomic context
+// and must not change the table behind a loader's back (loaders hold
+// load_lock, not tbl_lock, while they look entries up), so they queue the
+// pid and a work item unlinks and frees the policy.
+struct reap_req {
+  struct llist_node node;
+  u32 pid;
+  u64 start_time;
+};
+
+static LLIST_HEAD(reap_list);
+
+static void reap_policies(struct work_struct *work)
+{
+  struct llist_node *list = llist_del_all(&reap_list);
+  struct reap_req *r, *tmp;
+
+  llist_for_each_entry_safe(r, tmp, list, node) {
+    proc_policy_free(unlink_policy(r->pid, r->start_time));
+    kfree(r);
+  }
+}
+
+static DECLARE_WORK(reap_work, reap_policies);
+
+// Atomic context. If the allocation fails the entry stays until the next
+// attach to pid replaces it; the event probe ignores it meanwhile.
+static void queue_reap(u32 pid, u64 start_time)
+{
+  struct reap_req *r = kmalloc(sizeof(*r), GFP_ATOMIC);
+
+  if (!r) return;
+  r->pid = pid;
+  r->start_time = start_time;
+  llist_add(&r->node, &reap_list);
+  schedule_work(&reap_work);
+}
+
 // ---------------------- IOCTL interface ----------------------
 
 #define IOCTL_MAGIC 'L'
 #define IOCTL_LOAD_POLICY _IOW(IOCTL_MAGIC, 0x01, struct policy_blob*)
+#define IOCTL_LOAD_FUNC_POLICY _IOW(IOCTL_MAGIC, 0x02, struct policy_blob_v2*)
+#define IOCTL_LOAD_CHECKPOINTS _IOW(IOCTL_MAGIC, 0x03, struct checkpoint_blob*)
+#define IOCTL_GET_STATS _IOWR(IOCTL_MAGIC, 0x04, struct stats_query*)
+#define IOCTL_ATTACH_MANY _IOWR(IOCTL_MAGIC, 0x05, struct attach_many*)
+#define IOCTL_DETACH _IOW(IOCTL_MAGIC, 0x06, u32*)
 
-static long sandbox_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+// Engines a pid's automata use (pid_stats.engines)
+#define ENGINE_NFA        0x1
+#define ENGINE_CHECKPOINT 0x2
+
+#define MAX_STATS (1u << 16)
+#define MAX_ATTACH_PIDS (1u << 16)
+
+struct pid_stats {
+  u32 pid;
+  u32 id_mode;
+  u32 num_funcs;
+  u32 engines;     // ENGINE_*
+  u64 loaded_ns;
+  u64 events;
+  u64 total_ns;
+  u64 max_ns;
+  u64 violations;
+  u64 frontier;    // active NFA states; a checkpoint policy counts 1
+  u64 mem_bytes;   // kernel memory held by the policy
+  u64 lat_hist[LAT_BUCKETS]; // see lat_bucket()
+};
+
+// IOCTL_ATTACH_MANY: the given load ioctls, for each of num_pids pids
+struct attach_call {
+  u32 cmd;         // IOCTL_LOAD_POLICY, IOCTL_LOAD_FUNC_POLICY or IOCTL_LOAD_CHECKPOINTS
+  u32 reserved;
+  u64 blob;        // that ioctl's argument; its pid is ignored
+};
+
+struct attach_many {
+  u32 num_pids;
+  u32 num_calls;
+  u64 pids;        // u32[num_pids]
+  u64 calls;       // struct attach_call[num_calls]
+  u32 attached;    // out: pids that got every call
+  u32 skipped;     // out: pids that exited first (possibly after some calls)
+  // attached + skipped is the number of leading pids handled; on an error
+  // the pid at that index is the one that failed
+};
+
+// IOCTL_GET_STATS: one pid_stats per pid with a policy
+struct stats_query {
+  u32 max_entries; // capacity of the array that follows
+  u32 num_entries; // out: entries written
+  u32 total;       // out: pids with a policy; retry with more room if larger
+  u32 timing;      // out: whether latencies are measured
+  u64 now_ns;      // out: ktime_get_ns() at the snapshot
+  // Followed by max_entries * struct pid_stats
+};
+
+// Replace whatever pid had with a single-automaton policy. Consumes `a`.
+static long install_single(u32 pid, u64 start_time, u32 id_mode, struct automaton *a)
+{
+  struct proc_policy *pp, *old;
+  unsigned long flags;
+
+  pp = kzalloc(sizeof(*pp), GFP_KERNEL);
+  if (pp) pp->slots = kcalloc(1, sizeof(*pp->slots), GFP_KERNEL);
+  if (!pp || !pp->slots) { kfree(pp); automaton_free(a); return -ENOMEM; }
+  pp->pid = pid;
+  pp->start_time = start_time;
+  pp->id_mode = id_mode;
+  pp->loaded_ns = ktime_get_ns();
+  pp->num_slots = 1;
+  pp->num_funcs = 1;
+  pp->slots[0].a = a;
+
+  // create/replace entry
+  mutex_lock(&load_lock);
+  spin_lock_irqsave(&tbl_lock, flags);
+  old = lookup_ppid(pid);
+  if (old) hash_del(&old->hnode);
+  hash_add(proc_tbl, &pp->hnode, pp->pid);
+  spin_unlock_irqrestore(&tbl_lock, flags);
+  mutex_unlock(&load_lock);
+  proc_policy_free(old);
+  return 0;
+}
+
+// Add or replace one function of a global-ID policy. Consumes `a`.
+static long install_func(u32 pid, u64 start_time, u32 func_key, struct automaton *a)
 {
-  if (cmd == IOCTL_LOAD_POLICY) {
-    struct policy_blob hdr;
-    if (copy_from_user(&hdr, (void __user *)arg, sizeof(hdr)))
-      return -EFAULT;
-    if (hdr.num_nodes == 0 || hdr.num_edges > (1u<<20)) // sanity
-      return -EINVAL;
-
-    // allocate kernel copy
-    struct policy_blob *ub = (struct policy_blob*)arg;
-    struct edge *edges = kcalloc(hdr.num_edges, sizeof(struct edge), GFP_KERNEL);
-    if (!edges) return -ENOMEM;
-    if (copy_from_user(edges, (void __user *)(ub + 1), hdr.num_edges * sizeof(struct edge))) {
-      kfree(edges);
-      return -EFAULT;
+  struct proc_policy *pp, *fresh = NULL, *stale = NULL;
+  struct automaton *replaced = NULL;
+  struct func_slot *slot, *grown = NULL, *old_slots = NULL;
+  u32 grown_len = 0;
+  unsigned long flags;
+  long ret = 0;
+
+  mutex_lock(&load_lock);
+  pp = lookup_ppid(pid); // stable: only loaders change the table
+  if (!pp || pp->id_mode != ID_MODE_GLOBAL || pp->start_time != start_time) {
+    // First function for this task (a legacy policy, or one left by an
+    // earlier task with this pid, is replaced as a whole)
+    stale = pp;
+    fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+    if (!fresh) { ret = -ENOMEM; goto out; }
+    fresh->pid = pid;
+    fresh->start_time = start_time;
+    fresh->id_mode = ID_MODE_GLOBAL;
+    fresh->loaded_ns = ktime_get_ns();
+    pp = fresh;
+  }
+  slot = pp->num_slots ? slot_for(pp->slots, pp->num_slots, func_key) : NULL;
+  if (!slot || !slot->a) {
+    if (pp->num_funcs >= MAX_FUNCS) { ret = -ENOSPC; goto out; }
+    if ((pp->num_funcs + 1) * 2 > pp->num_slots) {
+      // Rehash into a table twice the size, off to the side
+      grown_len = max(8u, pp->num_slots * 2);
+      grown = kcalloc(grown_len, sizeof(*grown), GFP_KERNEL);
+      if (!grown) { ret = -ENOMEM; goto out; }
+      for (u32 i = 0; i < pp->num_slots; ++i)
+        if (pp->slots[i].a)
+          *slot_for(grown, grown_len, pp->slots[i].key) = pp->slots[i];
     }
+  }
+
+  spin_lock_irqsave(&tbl_lock, flags);
+  if (grown) {
+    old_slots = pp->slots;
+    pp->slots = grown;
+    pp->num_slots = grown_len;
+  }
+  slot = slot_for(pp->slots, pp->num_slots, func_key);
+  replaced = slot->a;
+  if (!replaced) pp->num_funcs++;
+  slot->key = func_key;
+  slot->a = a;
+  if (fresh) {
+    if (stale) hash_del(&stale->hnode);
+    hash_add(proc_tbl, &fresh->hnode, fresh->pid);
+  }
+  spin_unlock_irqrestore(&tbl_lock, flags);
+  a = NULL;
+  fresh = NULL;
+
+out:
+  mutex_unlock(&load_lock);
+  if (ret) {
+    // nothing was published; the existing entry stays in place
+    kfree(fresh);
+    kfree(grown);
+    stale = NULL;
+  }
+  proc_policy_free(stale);
+  kfree(old_slots);
+  automaton_free(replaced);
+  automaton_free(a);
+  return ret;
+}
+
+// A load ioctl's blob, read and validated. `a` is installed with
+// install_func() under func_key when id_mode is ID_MODE_GLOBAL, otherwise
+// with install_single().
+struct load_req {
+  u32 pid;
+  u32 id_mode;
+  u32 func_key;
+  struct automaton *a;
+};
+
+static long read_policy(unsigned long arg, struct load_req *r)
+{
+  struct policy_blob hdr;
+  struct policy_blob *ub = (struct policy_blob*)arg;
+
+  if (copy_from_user(&hdr, (void __user *)arg, sizeof(hdr)))
+    return -EFAULT;
+  if (hdr.id_mode != ID_MODE_DUMMY && hdr.id_mode != ID_MODE_UNIQUE)
+    return -EINVAL;
+
+  r->pid = hdr.pid;
+  r->id_mode = hdr.id_mode;
+  r->func_key = 0;
+  r->a = automaton_load((void __user *)(ub + 1), hdr.num_nodes, hdr.num_edges);
+  return IS_ERR(r->a) ? PTR_ERR(r->a) : 0;
+}
+
+static long read_func_policy(unsigned long arg, struct load_req *r)
+{
+  struct policy_blob_v2 hdr;
+  struct policy_blob_v2 *ub = (struct policy_blob_v2*)arg;
+
+  if (copy_from_user(&hdr, (void __user *)arg, sizeof(hdr)))
+    return -EFAULT;
+  if (hdr.id_mode != ID_MODE_GLOBAL)
+    return -EINVAL;
+
+  r->pid = hdr.pid;
+  r->id_mode = ID_MODE_GLOBAL;
+  r->func_key = hdr.func_key;
+  r->a = automaton_load((void __user *)(ub + 1), hdr.num_nodes, hdr.num_edges);
+  return IS_ERR(r->a) ? PTR_ERR(r->a) : 0;
+}
+
+static long read_checkpoints(unsigned long arg, struct load_req *r)
+{
+  struct checkpoint_blob hdr;
+  struct checkpoint_blob *ub = (struct checkpoint_blob*)arg;
+
+  if (copy_from_user(&hdr, (void __user *)arg, sizeof(hdr)))
+    return -EFAULT;
+  if (hdr.flags & ~CHECKPOINT_GLOBAL)
+    return -EINVAL;
+
+  r->pid = hdr.pid;
+  r->id_mode = (hdr.flags & CHECKPOINT_GLOBAL) ? ID_MODE_GLOBAL : ID_MODE_CHECKPOINT;
+  r->func_key = hdr.func_key;
+  r->a = checkpoints_load((void __user *)(ub + 1), hdr.num_checkpoints);
+  return IS_ERR(r->a) ? PTR_ERR(r->a) : 0;
+}
+
+static long read_load(u32 cmd, unsigned long arg, struct load_req *r)
+{
+  if (cmd == IOCTL_LOAD_POLICY)
+    return read_policy(arg, r);
+  if (cmd == IOCTL_LOAD_FUNC_POLICY)
+    return read_func_policy(arg, r);
+  if (cmd == IOCTL_LOAD_CHECKPOINTS)
+    return read_checkpoints(arg, r);
+  return -EINVAL;
+}
+
+// Install `a` for `pid` where `r` says. Consumes `a`. The policy is tied to
+// the task that has pid now; -ESRCH if there is none.
+static long install(u32 pid, const struct load_req *r, struct automaton *a)
+{
+  u64 start_time = task_start_time(pid);
+
+  if (!start_time) {
+    automaton_free(a);
+    return -ESRCH;
+  }
+  if (r->id_mode == ID_MODE_GLOBAL)
+    return install_func(pid, start_time, r->func_key, a);
+  return install_single(pid, start_time, r->id_mode, a);
+}
+
+static long load_policy(unsigned long arg)
+{
+  struct load_req r;
+  u32 nodes, edges;
+  long ret = read_policy(arg, &r);
+
+  if (ret) return ret;
+  nodes = r.a->num_nodes;
+  edges = r.a->num_edges;
+  ret = install(r.pid, &r, r.a);
+  if (ret) return ret;
+
+  pr_info(DEVICE_NAME ": loaded policy for pid=%u nodes=%u edges=%u mode=%s\n",
+          r.pid, nodes, edges, r.id_mode ? "unique" : "dummy");
+  return 0;
+}
+
+static long load_func_policy(unsigned long arg)
+{
+  struct load_req r;
+  u32 nodes, edges;
+  long ret = read_func_policy(arg, &r);
+
+  if (ret) return ret;
+  nodes = r.a->num_nodes;
+  edges = r.a->num_edges;
+  ret = install(r.pid, &r, r.a);
+  if (ret) return ret;
+
+  pr_info(DEVICE_NAME ": loaded function %#x for pid=%u nodes=%u edges=%u mode=global\n",
+          r.func_key, r.pid, nodes, edges);
+  return 0;
+}
+
+static long load_checkpoints(unsigned long arg)
+{
+  struct load_req r;
+  u32 count;
+  long ret = read_checkpoints(arg, &r);
+
+  if (ret) return ret;
+  count = r.a->num_checkpoints;
+  ret = install(r.pid, &r, r.a);
+  if (ret) return ret;
 
-    // create/replace entry
-    mutex_lock(&tbl_lock);
-    struct proc_policy *pp = lookup_ppid(hdr.pid);
-    if (pp) {
-      hash_del(&pp->hnode);
-      kfree(pp->edges);
-      frontier_free(&pp->fr);
-      kfree(pp);
+  pr_info(DEVICE_NAME ": loaded %u checkpoints for pid=%u%s\n",
+          count, r.pid, r.id_mode == ID_MODE_GLOBAL ? " (global)" : "");
+  return 0;
+}
+
+// Load the same calls for every pid: each blob is copied in and validated
+// once, then its automaton is duplicated per pid. Pids that exit meanwhile
+// are skipped.
+static long attach_many(unsigned long arg)
+{
+  struct attach_many hdr;
+  struct attach_many __user *uh = (struct attach_many __user *)arg;
+  struct attach_call *calls = NULL;
+  struct load_req *reqs = NULL;
+  u32 *pids = NULL, loaded = 0, attached = 0, skipped = 0;
+  long ret = 0;
+
+  if (copy_from_user(&hdr, uh, sizeof(hdr)))
+    return -EFAULT;
+  if (hdr.num_pids > MAX_ATTACH_PIDS || hdr.num_calls == 0 || hdr.num_calls > MAX_FUNCS)
+    return -EINVAL;
+
+  pids = kvmalloc_array(hdr.num_pids, sizeof(*pids), GFP_KERNEL);
+  calls = kvmalloc_array(hdr.num_calls, sizeof(*calls), GFP_KERNEL);
+  reqs = kvcalloc(hdr.num_calls, sizeof(*reqs), GFP_KERNEL);
+  if (!pids || !calls || !reqs) { ret = -ENOMEM; goto out; }
+  if (copy_from_user(pids, u64_to_user_ptr(hdr.pids), (size_t)hdr.num_pids * sizeof(*pids)) ||
+      copy_from_user(calls, u64_to_user_ptr(hdr.calls), (size_t)hdr.num_calls * sizeof(*calls))) {
+    ret = -EFAULT;
+    goto out;
+  }
+  for (; loaded < hdr.num_calls; ++loaded) {
+    ret = read_load(calls[loaded].cmd, (unsigned long)u64_to_user_ptr(calls[loaded].blob), &reqs[loaded]);
+    if (ret) goto out;
+  }
+
+  while (attached + skipped < hdr.num_pids) {
+    u32 pid = pids[attached + skipped];
+
+    for (u32 c = 0; c < hdr.num_calls && !ret; ++c) {
+      struct automaton *a = automaton_clone(reqs[c].a);
+      ret = a ? install(pid, &reqs[c], a) : -ENOMEM;
     }
-    pp = kzalloc(sizeof(*pp), GFP_KERNEL);
-    if (!pp) { mutex_unlock(&tbl_lock); kfree(edges); return -ENOMEM; }
-    pp->pid = hdr.pid;
-    pp->num_nodes = hdr.num_nodes;
-    pp->num_edges = hdr.num_edges;
-    pp->id_mode = hdr.id_mode;
-    pp->edges = edges;
-    frontier_init(&pp->fr, hdr.num_nodes);
-
-    // Initialize start set: nodes with in-degree 0
-    {
-      u32 *indeg = kcalloc(hdr.num_nodes, sizeof(u32), GFP_KERNEL);
-      if (indeg) {
-        for (u32 i = 0; i < hdr.num_edges; ++i) {
-          if (!edges[i].is_epsilon) // count only consuming edges for start heuristic
-            indeg[edges[i].dst]++;
-        }
-        for (u32 n = 0; n < hdr.num_nodes; ++n) {
-          if (indeg[n] == 0) frontier_set(&pp->fr, n);
-        }
-        kfree(indeg);
-      } else {
-        // fallback: start at node 0
-        frontier_set(&pp->fr, 0);
-      }
-      epsilon_closure(pp);
+    if (ret == -ESRCH) {
+      ret = 0;
+      skipped++;
+      continue;
+    }
+    if (ret) goto out;
+    attached++;
+  }
+  pr_info(DEVICE_NAME ": attached %u pids with %u automata each (%u exited)\n", attached, hdr.num_calls,
+          skipped);
+
+out:
+  for (u32 c = 0; c < loaded; ++c)
+    automaton_free(reqs[c].a);
+  if ((put_user(attached, &uh->attached) || put_user(skipped, &uh->skipped)) && !ret)
+    ret = -EFAULT;
+  kvfree(reqs);
+  kvfree(calls);
+  kvfree(pids);
+  return ret;
+}
+
+static u64 automaton_mem(const struct automaton *a)
+{
+  if (a->num_checkpoints)
+    return sizeof(*a) + (u64)(a->num_checkpoints + 1) * a->row_words * sizeof(u64);
+  return sizeof(*a) + (u64)a->num_edges * sizeof(struct edge) +
+         2 * BITS_TO_LONGS(a->num_nodes) * sizeof(unsigned long); // frontier and scratch
+}
+
+// Snapshot one pid. Call with load_lock held so its slots stay put.
+static void fill_stats(struct proc_policy *pp, struct pid_stats *s)
+{
+  unsigned long flags;
+
+  s->pid = pp->pid;
+  s->id_mode = pp->id_mode;
+  s->num_funcs = pp->num_funcs;
+  s->loaded_ns = pp->loaded_ns;
+  s->mem_bytes = sizeof(*pp) + (u64)pp->num_slots * sizeof(*pp->slots);
+
+  spin_lock_irqsave(&tbl_lock, flags);
+  s->events = pp->events;
+  s->total_ns = pp->total_ns;
+  s->max_ns = pp->max_ns;
+  s->violations = pp->violations;
+  memcpy(s->lat_hist, pp->lat_hist, sizeof(s->lat_hist));
+  for (u32 i = 0; i < pp->num_slots; ++i) {
+    struct automaton *a = pp->slots[i].a;
+    if (!a) continue;
+    s->mem_bytes += automaton_mem(a);
+    if (a->num_checkpoints) {
+      s->engines |= ENGINE_CHECKPOINT;
+      s->frontier++;
+    } else {
+      s->engines |= ENGINE_NFA;
+      s->frontier += bitmap_weight(a->fr.bitmap, a->fr.num_nodes);
     }
+  }
+  spin_unlock_irqrestore(&tbl_lock, flags);
+}
 
-    hash_add(proc_tbl, &pp->hnode, pp->pid);
-    mutex_unlock(&tbl_lock);
+static long get_stats(unsigned long arg)
+{
+  struct stats_query q;
+  struct stats_query __user *uq = (struct stats_query __user *)arg;
+  struct pid_stats *buf = NULL;
+  struct proc_policy *pp;
+  u32 n = 0, total = 0;
+  long ret = 0;
+  int bkt;
 
-    pr_info(DEVICE_NAME ": loaded policy for pid=%u nodes=%u edges=%u mode=%s\n",
-            pp->pid, pp->num_nodes, pp->num_edges, pp->id_mode ? "unique" : "dummy");
-    return 0;
+  if (copy_from_user(&q, uq, sizeof(q)))
+    return -EFAULT;
+  q.max_entries = min(q.max_entries, MAX_STATS);
+  if (q.max_entries) {
+    buf = kvcalloc(q.max_entries, sizeof(*buf), GFP_KERNEL);
+    if (!buf) return -ENOMEM;
   }
+
+  mutex_lock(&load_lock); // only loaders change the table
+  hash_for_each(proc_tbl, bkt, pp, hnode) {
+    if (n < q.max_entries) fill_stats(pp, &buf[n++]);
+    total++;
+  }
+  mutex_unlock(&load_lock);
+
+  q.num_entries = n;
+  q.total = total;
+  q.timing = timing;
+  q.now_ns = ktime_get_ns();
+  if (copy_to_user(uq, &q, sizeof(q)) ||
+      (n && copy_to_user((void __user *)(uq + 1), buf, (size_t)n * sizeof(*buf))))
+    ret = -EFAULT;
+  kvfree(buf);
+  return ret;
+}
+
+static long detach(unsigned long arg)
+{
+  struct proc_policy *pp;
+  u32 pid;
+
+  if (get_user(pid, (u32 __user *)arg))
+    return -EFAULT;
+  pp = unlink_policy(pid, 0);
+  if (!pp) return -ENOENT;
+  proc_policy_free(pp);
+  return 0;
+}
+
+static long sandbox_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+  if (cmd == IOCTL_LOAD_POLICY)
+    return load_policy(arg);
+  if (cmd == IOCTL_LOAD_FUNC_POLICY)
+    return load_func_policy(arg);
+  if (cmd == IOCTL_LOAD_CHECKPOINTS)
+    return load_checkpoints(arg);
+  if (cmd == IOCTL_GET_STATS)
+    return get_stats(arg);
+  if (cmd == IOCTL_ATTACH_MANY)
+    return attach_many(arg);
+  if (cmd == IOCTL_DETACH)
+    return detach(arg);
   return -ENOTTY;
 }
 
@@ -242,22 +951,69 @@ static struct kprobe kp = {
 static int handler_pre(struct kprobe *p, struct pt_regs *regs)
 {
 #ifdef CONFIG_X86_64
-  s32 id = (s32)regs->di; // first arg
+  u64 raw = regs->di; // first arg
 #else
-  s32 id = 0; // TODO: arch-specific
+  u64 raw = 0; // TODO: arch-specific
 #endif
   u32 pid = (u32)task_pid_nr(current);
+  struct proc_policy *pp;
+  struct automaton *a = NULL;
+  s32 id = (s32)raw;
+  unsigned long flags;
 
-  mutex_lock(&tbl_lock);
-  struct proc_policy *pp = lookup_ppid(pid);
+  spin_lock_irqsave(&tbl_lock, flags);
+  pp = lookup_ppid(pid);
+  if (pp && pp->start_time != current->start_time) {
+    // Left by an earlier task with this pid (it exited while being attached)
+    queue_reap(pid, pp->start_time);
+    pp = NULL;
+  }
   if (pp) {
-    advance_frontier(pp, id);
-    if (frontier_empty(&pp->fr)) {
-      pr_err(DEVICE_NAME ": policy violation pid=%u on id=%d, sending SIGKILL\n", pid, id);
+    if (pp->id_mode == ID_MODE_GLOBAL) {
+      id = (s32)(u32)raw; // site index
+      if (pp->num_slots) // functions without a loaded automaton are not enforced
+        a = slot_for(pp->slots, pp->num_slots, (u32)(raw >> 32))->a;
+    } else {
+      a = pp->slots[0].a;
+    }
+  }
+  if (a) {
+    u64 t0 = timing ? ktime_get_ns() : 0;
+    bool ok = automaton_step(a, id);
+
+    pp->events++;
+    if (timing) {
+      u64 ns = ktime_get_ns() - t0;
+      pp->total_ns += ns;
+      pp->max_ns = max(pp->max_ns, ns);
+      pp->lat_hist[lat_bucket(ns)]++;
+    }
+    if (!ok) {
+      pp->violations++;
+      pr_err(DEVICE_NAME ": policy violation pid=%u on id=%llu, sending SIGKILL\n", pid, raw);
       send_sig(SIGKILL, current, 0);
     }
   }
-  mutex_unlock(&tbl_lock);
+  spin_unlock_irqrestore(&tbl_lock, flags);
+  return 0;
+}
+
+// Task exit: drop its policy so the table does not grow with every process
+// ever attached, and a recycled pid starts without one
+static struct kprobe exit_kp = {
+  .symbol_name = "do_exit",
+};
+
+static int exit_pre(struct kprobe *p, struct pt_regs *regs)
+{
+  u32 pid = (u32)task_pid_nr(current);
+  bool attached;
+  unsigned long flags;
+
+  spin_lock_irqsave(&tbl_lock, flags);
+  attached = lookup_ppid(pid) != NULL;
+  spin_unlock_irqrestore(&tbl_lock, flags);
+  if (attached) queue_reap(pid, current->start_time);
   return 0;
 }
 
@@ -273,6 +1029,14 @@ static int __init sandbox_init(void)
     misc_deregister(&sandbox_dev);
     return ret;
   }
+  exit_kp.pre_handler = exit_pre;
+  ret = register_kprobe(&exit_kp);
+  if (ret) {
+    pr_err(DEVICE_NAME ": do_exit kprobe register failed: %d\n", ret);
+    unregister_kprobe(&kp);
+    misc_deregister(&sandbox_dev);
+    return ret;
+  }
 
   pr_info(DEVICE_NAME ": initialized; device /dev/%s\n", DEVICE_NAME);
   return 0;
@@ -281,20 +1045,20 @@ static int __init sandbox_init(void)
 static void __exit sandbox_exit(void)
 {
   unregister_kprobe(&kp);
+  unregister_kprobe(&exit_kp);
   misc_deregister(&sandbox_dev);
+  flush_work(&reap_work); // no probe can queue more
 
   // free policies
   int bkt;
   struct proc_policy *pp;
   struct hlist_node *tmp;
-  mutex_lock(&tbl_lock);
+  mutex_lock(&load_lock);
   hash_for_each_safe(proc_tbl, bkt, tmp, pp, hnode) {
     hash_del(&pp->hnode);
-    kfree(pp->edges);
-    frontier_free(&pp->fr);
-    kfree(pp);
+    proc_policy_free(pp);
   }
-  mutex_unlock(&tbl_lock);
+  mutex_unlock(&load_lock);
 }
 
 module_init(sandbox_init);
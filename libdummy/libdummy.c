@@ -1,6 +1,7 @@
 
 // SPDX-License-Identifier: MIT
 #include "libdummy.h"
+#include <errno.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 
@@ -10,6 +11,16 @@
 #define __NR_dummy 451
 #endif
 
+// The pass declares these as touching only memory the program cannot see, so
+// a failed syscall (e.g. ENOSYS without the module) must not leave errno set.
 void dummy(int id) {
+  int saved = errno;
   (void)syscall(__NR_dummy, id);
+  errno = saved;
+}
+
+void dummy64(uint64_t id) {
+  int saved = errno;
+  (void)syscall(__NR_dummy, id);
+  errno = saved;
 }
@@ -1,9 +1,15 @@
 
 #pragma once
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 void dummy(int id);
+// Global IDs (-libcall-id-mode=global): funcKey << 32 | site index. funcKey is
+// the low 32 bits of the MD5 of the symbol name, salted with the module
+// identifier for local symbols (LibCallPass functionKey()). Two functions may
+// share a key; libcall-link and sandboxctl compile reject such policies.
+void dummy64(uint64_t id);
 #ifdef __cplusplus
 }
 #endif
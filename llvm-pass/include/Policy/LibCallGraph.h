@@ -1,4 +1,3 @@
-
 #pragma once
 #include <string>
 #include <vector>
@@ -7,35 +6,70 @@
 #include <list>
 #include <optional>
 
-namespace policy {
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/StringSaver.h"
 
-struct NeighborEdge {
-  size_t target;        // index of target node
-  std::string label;    // libcall name or "epsilon" (ϵ)
-};
+namespace llvm {
+class raw_ostream;
+namespace json {
+class Object;
+}
+}
 
-struct Node {
-  size_t nextNode = SIZE_MAX; // optional linear "next" pointer (unused in DOT)
-  std::vector<size_t> viewedCalls; // neighbor node indices
-  int dummyID = -1; // hashed id
-  int uniqueID = -1; // optional unique id (site order) for unique-mode
-  std::string pretty; // callee name
-};
+namespace policy {
 
-struct Graph {
+// Per-function automaton, built in two phases. While building, addNode() and
+// addEdge() only append to flat lists; freeze() then packs the edges into CSR
+// arrays (offsets + targets + labels) allocated from the graph's arena. The
+// DOT and JSON exports walk the edges through edgeBegin()/edgeEnd().
+//
+// Node attributes are kept as parallel arrays indexed by node (SoA). Labels
+// are interned in the arena, so nodes and edges only hold StringRefs.
+class Graph {
+public:
   std::string functionName;
-  std::vector<Node> nodes;
-  std::vector<NeighborEdge> edges;
-  std::vector<std::vector<size_t>> adj;
 
-  void addNode(const std::string &pretty = "");
-  size_t addNodeRetIndex(const std::string &pretty = "");
-  size_t addEdge(size_t src, size_t dst, const std::string &label);
+  Graph() : labelSaver(arena) {}
+  Graph(const Graph &) = delete;
+  Graph &operator=(const Graph &) = delete;
+
+  // Build phase
+  size_t addNode(llvm::StringRef pretty = "");
+  void addEdge(size_t src, size_t dst, llvm::StringRef label);
+  void freeze();
+  bool isFrozen() const { return frozen; }
+
+  size_t numNodes() const { return nodeLabels.size(); }
+  size_t numEdges() const { return frozen ? offsets[numNodes()] : pending.size(); }
+
+  // Node attributes
+  llvm::StringRef label(size_t n) const { return nodeLabels[n]; }
+  int dummyID(size_t n) const { return dummyIDs[n]; }
+  int uniqueID(size_t n) const { return uniqueIDs[n]; }
+  void setIDs(size_t n, int dummy, int unique) {
+    dummyIDs[n] = dummy;
+    uniqueIDs[n] = unique;
+  }
+
+  // Frozen adjacency: the outgoing edges of `src` are the index range
+  // [edgeBegin(src), edgeEnd(src)) into target()/edgeLabel().
+  uint32_t edgeBegin(size_t src) const { return offsets[src]; }
+  uint32_t edgeEnd(size_t src) const { return offsets[src + 1]; }
+  uint32_t target(uint32_t e) const { return targets[e]; }
+  llvm::StringRef edgeLabel(uint32_t e) const { return edgeLabels[e]; }
+
   std::string toDOT() const;
+  void writeDOT(llvm::raw_ostream &os) const; // streams without buffering the text
 
-  // Hash table with modulo buckets (bucketed linked lists of node indices)
+  // ID -> states index: a hash table with modulo buckets (bucketed linked
+  // lists of node indices). Several states share an ID once the dummy
+  // counter wraps past `mod`, so a lookup returns a list.
   struct BucketNode {
     size_t nodeIndex;
+    int id;      // full ID, so lookups can skip other IDs in the same bucket
     size_t next; // index into bucketPool or SIZE_MAX
   };
   std::vector<size_t> buckets; // head index per bucket into bucketPool
@@ -43,7 +77,29 @@ struct Graph {
   size_t mod = 200;
 
   void initBuckets(size_t m);
-  void insertIntoBuckets(size_t nodeIndex, int dummyID);
+  void insertIntoBuckets(size_t nodeIndex, int id);
+  std::vector<uint32_t> statesForID(int id) const; // ascending node indices
+  std::vector<int> indexedIDs() const;             // ascending, distinct
+
+private:
+  struct PendingEdge {
+    uint32_t src;
+    uint32_t dst;
+    llvm::StringRef label;
+  };
+
+  llvm::BumpPtrAllocator arena;
+  llvm::UniqueStringSaver labelSaver;
+
+  std::vector<llvm::StringRef> nodeLabels;
+  std::vector<int> dummyIDs;  // hashed id, -1 until assigned
+  std::vector<int> uniqueIDs; // site order id, -1 until assigned
+
+  std::vector<PendingEdge> pending; // build phase only; released by freeze()
+  bool frozen = false;
+  uint32_t *offsets = nullptr;           // numNodes + 1 entries
+  uint32_t *targets = nullptr;           // numEdges entries
+  llvm::StringRef *edgeLabels = nullptr; // numEdges entries ("ϵ" or callee name)
 };
 
 struct PolicyJSON {
@@ -63,19 +119,60 @@ struct PolicyJSON {
   };
   struct FuncPolicy {
     std::string functionName;
+    uint32_t funcIndex = 0; // position among the module's (or, linked, program's) definitions
+    uint32_t funcKey = 0;   // upper 32 bits of global IDs (LibCallPass::functionKey)
+    int64_t aliasOf = -1;   // linked only: funcIndex of an identical automaton
     std::vector<LibCallSite> callsInOrder;
     size_t mod = 200;
-    std::string idMode; // "unique" or "dummy"
+    std::string idMode; // "unique", "dummy" or "global" (funcKey << 32 | uniqueID)
     // Full graph export:
     std::vector<std::string> nodeLabels; // pretty names
     std::vector<int> nodeDummyIDs;
     std::vector<int> nodeUniqueIDs;
     std::vector<Edge> edges; // adjacency
+    // ID -> states (Graph::statesForID), keyed by the IDs of idMode
+    struct IDStates {
+      int id;
+      std::vector<uint32_t> states;
+    };
+    std::vector<IDStates> idStates;
+    // Checkpoint mode (region > 0): checkpoint i has ID i + 1. `start` holds
+    // the checkpoints that may come first, reach[i] those that may follow
+    // checkpoint i. Serialized as hex bitsets, bit 0 in the first digit.
+    struct Checkpoints {
+      unsigned region = 0;
+      llvm::BitVector start;
+      std::vector<llvm::BitVector> reach;
+    };
+    Checkpoints checkpoints;
   };
 
   std::vector<FuncPolicy> functions;
 
   std::string serialize() const;
+  // One entry of the "functions" array, exactly as serialize() writes it.
+  static std::string serializeFunction(const FuncPolicy &f);
+  // Inverse of serializeFunction(); false if `json` is not a function entry.
+  static bool parseFunction(llvm::StringRef json, FuncPolicy &f);
+  static bool parseFunction(const llvm::json::Object &json, FuncPolicy &f);
+  // Automaton semantics shared by the emitters and the analyzer
+  static bool isEpsilon(const Edge &E) { return E.label == "ϵ"; }
+  // ID an edge consumes under f.idMode; -1 for ϵ-edges
+  static int matchID(const FuncPolicy &f, const Edge &E) {
+    if (isEpsilon(E)) return -1;
+    return f.idMode == "dummy" ? E.matchDummy : E.matchUnique;
+  }
+  // ϵ-closure of every state, as sorted state lists
+  static std::vector<std::vector<size_t>> epsilonClosures(const FuncPolicy &f);
+  // Kernel start frontier: states without consuming in-edges, ϵ-closed
+  static std::vector<bool> startStates(const FuncPolicy &f,
+                                       const std::vector<std::vector<size_t>> &closures);
+  // Top-level document around already serialized function entries. A
+  // non-empty `module` is recorded so per-module outputs can be told apart.
+  static std::string assemble(const std::vector<std::string> &functionEntries,
+                              const std::string &module = "");
+  static void assemble(llvm::raw_ostream &os, llvm::ArrayRef<std::string> functionEntries,
+                       llvm::StringRef module = "");
 };
 
 } // namespace policy
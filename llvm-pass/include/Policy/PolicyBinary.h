@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "Policy/LibCallGraph.h"
+
+namespace policy {
+
+// Automaton of `f` as the kernel consumes it: LCPB edges (match IDs of
+// f.idMode), then the checkpoint rows. Two functions with equal encodings
+// enforce the same policy, which is what libcall-link dedupes on.
+std::string encodeAutomaton(const PolicyJSON::FuncPolicy &f);
+
+// LCPB image (Policy/PolicyFormat.h) of `functions`. Entries with aliasOf set
+// share the automaton of the function with that funcIndex.
+std::string emitPolicyBinary(const std::vector<PolicyJSON::FuncPolicy> &functions);
+
+} // namespace policy
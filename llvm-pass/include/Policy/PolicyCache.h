@@ -0,0 +1,29 @@
+#pragma once
+#include <optional>
+#include <string>
+
+namespace policy {
+
+// Cached pass results for one function, keyed by a hash of the IR structure
+// the analysis depends on (see LibCallPass::hashFunction).
+struct CacheEntry {
+  std::string policyJSON; // serialized FuncPolicy (PolicyJSON::serializeFunction)
+  std::string dot;        // DOT text for the function graph
+};
+
+// On-disk cache: one file per key inside `dir`. Entries are written to a
+// temporary file and renamed into place, so concurrent writers are safe.
+class ResultCache {
+public:
+  explicit ResultCache(std::string dir);
+
+  bool enabled() const { return !dir.empty(); }
+  std::optional<CacheEntry> lookup(const std::string &key) const;
+  void store(const std::string &key, const CacheEntry &entry) const;
+
+private:
+  std::string pathFor(const std::string &key) const;
+  std::string dir;
+};
+
+} // namespace policy
@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "Policy/LibCallGraph.h"
+
+namespace policy {
+
+// C++17 header with one policy struct per function: constexpr transition
+// tables, plus start()/advance() with the ϵ-closure folded in at generation
+// time and the transitions unrolled into a switch over the event ID. A
+// Checker<Policy> keeps the frontier in a std::bitset<NumStates>, so the
+// compiler specializes each checker for its function. Semantics match the
+// kernel module (start = states without consuming in-edges).
+std::string emitCxxHeader(const std::vector<PolicyJSON::FuncPolicy> &functions,
+                          const std::string &module = "");
+
+} // namespace policy
@@ -0,0 +1,87 @@
+/* LCPB: binary program policy written by libcall-link and read by sandboxctl.
+ *
+ * Plain C so sandboxctl can include it. Little-endian, every section starts on
+ * an 8-byte boundary, and all offsets are from the start of the header, so a
+ * loader can mmap the file and index into it without parsing:
+ *
+ *   header | functions[num_functions] | index[num_buckets] |
+ *   automata[num_automata] | strings |
+ *   per automaton: edges[num_edges], then (num_checkpoints + 1) checkpoint
+ *   rows of row_words(num_checkpoints) u64 each (row 0 the start set)
+ *
+ * Functions with identical automata share one automaton entry. The index is
+ * an open-addressed hash table over function names (lcpb_name_hash, linear
+ * probing), so a loader finds a function by name or by position without
+ * walking the table.
+ */
+#ifndef LIBCALL_POLICY_FORMAT_H
+#define LIBCALL_POLICY_FORMAT_H
+
+#include <stdint.h>
+
+#define LCPB_MAGIC "LCPB"
+#define LCPB_VERSION 2
+
+/* Same values as the kernel module's ID_MODE_* */
+#define LCPB_ID_DUMMY  0
+#define LCPB_ID_UNIQUE 1
+#define LCPB_ID_GLOBAL 2
+
+struct lcpb_header {
+  char magic[4];           /* LCPB_MAGIC, not NUL-terminated */
+  uint32_t version;        /* LCPB_VERSION */
+  uint64_t total_size;     /* file size in bytes */
+  uint32_t id_mode;        /* LCPB_ID_*, shared by every function */
+  uint32_t num_functions;
+  uint32_t num_automata;
+  uint32_t num_buckets;    /* name index size: a power of two, or 0 */
+  uint64_t functions_offset;
+  uint64_t automata_offset;
+  uint64_t strings_offset; /* NUL-terminated function names */
+  uint64_t strings_size;
+  uint64_t index_offset;
+};
+
+struct lcpb_function {
+  uint32_t func_key;       /* high 32 bits of global IDs */
+  uint32_t name_offset;    /* into the string section */
+  uint32_t automaton;      /* index into the automata table */
+  uint32_t reserved;
+};
+
+struct lcpb_automaton {
+  uint64_t edges_offset;
+  uint64_t rows_offset;    /* 0 without checkpoints */
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t num_checkpoints;
+  uint32_t reserved;
+};
+
+/* The kernel's struct edge: match_id is the ID of the header's id_mode, or -1
+ * with is_epsilon set. Edge arrays can go to the load ioctls as they are. */
+struct lcpb_edge {
+  uint32_t src;
+  uint32_t dst;
+  int32_t match_id;
+  uint8_t is_epsilon;
+} __attribute__((packed));
+
+/* Name index slot; `function` is LCPB_NO_FUNCTION in an empty slot */
+#define LCPB_NO_FUNCTION 0xffffffffu
+struct lcpb_bucket {
+  uint32_t hash;           /* lcpb_name_hash of the function's name */
+  uint32_t function;       /* index into the function table */
+};
+
+/* 32-bit FNV-1a */
+static inline uint32_t lcpb_name_hash(const char *name)
+{
+  uint32_t h = 2166136261u;
+  for (; *name; ++name) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h;
+}
+
+#define LCPB_ROW_WORDS(num_checkpoints) (((uint64_t)(num_checkpoints) + 63) / 64)
+
+#endif /* LIBCALL_POLICY_FORMAT_H */
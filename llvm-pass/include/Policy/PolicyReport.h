@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Policy/LibCallGraph.h"
+
+namespace policy {
+
+// What a function's policy costs to enforce. Frontier and DFA figures come
+// from a subset construction over the kernel's semantics (start frontier,
+// then one ϵ-closed step per event), stopped after `dfaLimit` subsets.
+struct PolicyCost {
+  std::string functionName;
+  uint32_t funcIndex = 0;
+  uint32_t funcKey = 0;
+  size_t states = 0;
+  size_t edges = 0;
+  size_t epsilonEdges = 0;
+  size_t alphabet = 0;          // distinct IDs the automaton consumes
+  size_t maxEpsilonClosure = 0;
+  size_t maxFrontier = 0;       // over the explored subsets
+  size_t dfaStates = 0;         // reachable non-empty subsets
+  size_t dfaTransitions = 0;
+  bool dfaComplete = true;      // false when dfaLimit stopped the construction
+  std::map<size_t, size_t> outDegree; // bucket 0, 1, 2-3, 4-7, ... (by lower bound) -> states
+  size_t checkpoints = 0;
+  // Predicted kernel memory per engine, allocator rounding included. "dfa"
+  // is the dense table a determinizing engine would need.
+  uint64_t nfaBytes = 0;
+  uint64_t checkpointBytes = 0; // 0 without checkpoints
+  uint64_t dfaBytes = 0;
+  std::vector<std::string> flagged; // budgets this function exceeds
+};
+
+// Budgets for flagging; 0 disables a check.
+struct PolicyBudget {
+  size_t dfaLimit = 10000;
+  size_t maxFrontier = 0;
+  size_t maxDFAStates = 0;
+  uint64_t maxKernelBytes = 0; // of the engine the policy loads (NFA or checkpoints)
+};
+
+PolicyCost analyzePolicy(const PolicyJSON::FuncPolicy &f, const PolicyBudget &budget);
+
+// Report document: one entry per function plus totals. A non-empty `module`
+// is recorded, as in the policy JSON.
+void writePolicyReport(llvm::raw_ostream &os, const std::vector<PolicyCost> &costs,
+                       const PolicyBudget &budget, llvm::StringRef module = "");
+
+} // namespace policy
@@ -1,55 +1,76 @@
 
 #include "Policy/LibCallGraph.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cassert>
 #include <sstream>
 
 using namespace policy;
 
-void Graph::addNode(const std::string &pretty) {
-  Node n;
-  n.pretty = pretty;
-  nodes.push_back(n);
-  adj.emplace_back();
+size_t Graph::addNode(llvm::StringRef pretty) {
+  assert(!frozen && "graph is frozen");
+  size_t idx = nodeLabels.size();
+  nodeLabels.push_back(pretty.empty() ? llvm::StringRef() : labelSaver.save(pretty));
+  dummyIDs.push_back(-1);
+  uniqueIDs.push_back(-1);
+  return idx;
 }
 
-size_t Graph::addNodeRetIndex(const std::string &pretty) {
-  Node n;
-  n.pretty = pretty;
-  size_t idx = nodes.size();
-  nodes.push_back(n);
-  adj.emplace_back();
-  return idx;
+void Graph::addEdge(size_t src, size_t dst, llvm::StringRef label) {
+  assert(!frozen && "graph is frozen");
+  pending.push_back({static_cast<uint32_t>(src), static_cast<uint32_t>(dst),
+                     labelSaver.save(label)});
 }
 
-size_t Graph::addEdge(size_t src, size_t dst, const std::string &label) {
-  NeighborEdge e{dst, label};
-  size_t id = edges.size();
-  edges.push_back(e);
-  adj[src].push_back(id);
-  nodes[src].viewedCalls.push_back(dst);
-  return id;
+void Graph::freeze() {
+  if (frozen) return;
+  size_t n = numNodes();
+  size_t m = pending.size();
+  offsets = arena.Allocate<uint32_t>(n + 1);
+  targets = arena.Allocate<uint32_t>(m);
+  edgeLabels = arena.Allocate<llvm::StringRef>(m);
+
+  // Counting sort by source; stable, so each node keeps its insertion order.
+  std::fill(offsets, offsets + n + 1, 0);
+  for (const auto &e : pending) offsets[e.src + 1]++;
+  for (size_t i = 0; i < n; ++i) offsets[i + 1] += offsets[i];
+  std::vector<uint32_t> cursor(offsets, offsets + n);
+  for (const auto &e : pending) {
+    uint32_t slot = cursor[e.src]++;
+    targets[slot] = e.dst;
+    new (&edgeLabels[slot]) llvm::StringRef(e.label);
+  }
+
+  std::vector<PendingEdge>().swap(pending);
+  frozen = true;
 }
 
 std::string Graph::toDOT() const {
-  std::ostringstream os;
+  std::string out;
+  llvm::raw_string_ostream os(out);
+  writeDOT(os);
+  return os.str();
+}
+
+void Graph::writeDOT(llvm::raw_ostream &os) const {
+  assert(frozen && "DOT export needs a frozen graph");
   os << "digraph \"" << functionName << "\" {\n";
   os << "  rankdir=LR;\n";
-  for (size_t i = 0; i < nodes.size(); ++i) {
-    const auto &n = nodes[i];
-    std::ostringstream label;
-    label << "n" << i;
-    if (!n.pretty.empty()) label << "\\n" << n.pretty;
-    if (n.dummyID >= 0) label << "\\n(dummy=" << n.dummyID << ")";
-    if (n.uniqueID >= 0) label << "\\n(uid=" << n.uniqueID << ")";
-    os << "  n" << i << " [shape=circle,label=\"" << label.str() << "\"];\n";
-  }
-  for (size_t src = 0; src < adj.size(); ++src) {
-    for (auto eid : adj[src]) {
-      const auto &e = edges[eid];
-      os << "  n" << src << " -> n" << e.target << " [label=\"" << e.label << "\"];\n";
+  for (size_t i = 0; i < numNodes(); ++i) {
+    os << "  n" << i << " [shape=circle,label=\"n" << i;
+    if (!nodeLabels[i].empty()) os << "\\n" << nodeLabels[i];
+    if (dummyIDs[i] >= 0) os << "\\n(dummy=" << dummyIDs[i] << ")";
+    if (uniqueIDs[i] >= 0) os << "\\n(uid=" << uniqueIDs[i] << ")";
+    os << "\"];\n";
+  }
+  for (size_t src = 0; src < numNodes(); ++src) {
+    for (uint32_t e = edgeBegin(src); e < edgeEnd(src); ++e) {
+      os << "  n" << src << " -> n" << targets[e] << " [label=\"" << edgeLabels[e] << "\"];\n";
     }
   }
   os << "}\n";
-  return os.str();
 }
 
 void Graph::initBuckets(size_t m) {
@@ -58,66 +79,293 @@ void Graph::initBuckets(size_t m) {
   bucketPool.clear();
 }
 
-void Graph::insertIntoBuckets(size_t nodeIndex, int dummyID) {
-  if (mod == 0) return;
-  size_t key = static_cast<size_t>(dummyID % static_cast<int>(mod));
-  BucketNode bn{nodeIndex, buckets[key]};
+void Graph::insertIntoBuckets(size_t nodeIndex, int id) {
+  if (mod == 0 || id < 0) return;
+  size_t key = static_cast<size_t>(id) % mod;
+  BucketNode bn{nodeIndex, id, buckets[key]};
   size_t idx = bucketPool.size();
   bucketPool.push_back(bn);
   buckets[key] = idx;
 }
 
+std::vector<uint32_t> Graph::statesForID(int id) const {
+  std::vector<uint32_t> states;
+  if (mod == 0 || id < 0) return states;
+  for (size_t i = buckets[static_cast<size_t>(id) % mod]; i != SIZE_MAX; i = bucketPool[i].next) {
+    if (bucketPool[i].id == id) states.push_back(static_cast<uint32_t>(bucketPool[i].nodeIndex));
+  }
+  // Chains are built by head insertion, i.e. newest first.
+  std::sort(states.begin(), states.end());
+  return states;
+}
+
+std::vector<int> Graph::indexedIDs() const {
+  std::vector<int> ids;
+  ids.reserve(bucketPool.size());
+  for (const auto &bn : bucketPool) ids.push_back(bn.id);
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
 std::string PolicyJSON::serialize() const {
+  std::vector<std::string> entries;
+  entries.reserve(functions.size());
+  for (const auto &f : functions) entries.push_back(serializeFunction(f));
+  return assemble(entries);
+}
+
+std::string PolicyJSON::assemble(const std::vector<std::string> &functionEntries,
+                                 const std::string &module) {
+  std::string out;
+  llvm::raw_string_ostream os(out);
+  assemble(os, functionEntries, module);
+  return os.str();
+}
+
+void PolicyJSON::assemble(llvm::raw_ostream &os, llvm::ArrayRef<std::string> functionEntries,
+                          llvm::StringRef module) {
+  os << "{\n";
+  if (!module.empty()) os << "  \"module\": \"" << module << "\",\n";
+  os << "  \"functions\": [\n";
+  for (size_t i = 0; i < functionEntries.size(); ++i) {
+    os << functionEntries[i];
+    if (i + 1 < functionEntries.size()) os << ",";
+    os << "\n";
+  }
+  os << "  ]\n}\n";
+}
+
+std::vector<std::vector<size_t>> PolicyJSON::epsilonClosures(const FuncPolicy &f) {
+  size_t N = f.nodeLabels.size();
+  std::vector<std::vector<size_t>> eps(N);
+  for (const auto &E : f.edges)
+    if (isEpsilon(E) && E.src < N && E.dst < N) eps[E.src].push_back(E.dst);
+  std::vector<std::vector<size_t>> out(N);
+  std::vector<bool> seen(N);
+  for (size_t n = 0; n < N; ++n) {
+    std::fill(seen.begin(), seen.end(), false);
+    std::vector<size_t> work = {n};
+    seen[n] = true;
+    while (!work.empty()) {
+      size_t s = work.back();
+      work.pop_back();
+      for (size_t d : eps[s])
+        if (!seen[d]) seen[d] = true, work.push_back(d);
+    }
+    for (size_t s = 0; s < N; ++s)
+      if (seen[s]) out[n].push_back(s);
+  }
+  return out;
+}
+
+std::vector<bool> PolicyJSON::startStates(const FuncPolicy &f,
+                                          const std::vector<std::vector<size_t>> &closures) {
+  size_t N = f.nodeLabels.size();
+  std::vector<bool> consumingIn(N), start(N);
+  for (const auto &E : f.edges)
+    if (!isEpsilon(E) && E.dst < N) consumingIn[E.dst] = true;
+  for (size_t n = 0; n < N; ++n)
+    if (!consumingIn[n])
+      for (size_t s : closures[n]) start[s] = true;
+  return start;
+}
+
+// Four bits per digit, lowest first; trailing zero digits are dropped, so
+// sparse rows stay short and an empty set is "".
+static std::string hexBitset(const llvm::BitVector &BV) {
+  std::string out;
+  for (size_t i = 0; i < BV.size(); i += 4) {
+    unsigned nibble = 0;
+    for (size_t b = 0; b < 4 && i + b < BV.size(); ++b)
+      if (BV[i + b]) nibble |= 1u << b;
+    out += "0123456789abcdef"[nibble];
+  }
+  while (!out.empty() && out.back() == '0') out.pop_back();
+  return out;
+}
+
+// Inverse of hexBitset(); false on a non-hex digit or a bit at `size` or above.
+static bool parseHexBitset(llvm::StringRef hex, size_t size, llvm::BitVector &BV) {
+  BV.clear();
+  BV.resize(size);
+  for (size_t k = 0; k < hex.size(); ++k) {
+    unsigned nibble = llvm::hexDigitValue(hex[k]);
+    if (nibble == ~0u) return false;
+    for (size_t b = 0; b < 4; ++b) {
+      if (!(nibble >> b & 1)) continue;
+      if (4 * k + b >= size) return false;
+      BV.set(4 * k + b);
+    }
+  }
+  return true;
+}
+
+// The kernel's MAX_CHECKPOINTS (sandboxctl's JSON_MAX_CHECKPOINTS): the
+// reach matrix is quadratic in it
+static const int64_t MaxCheckpoints = 8192;
+
+std::string PolicyJSON::serializeFunction(const FuncPolicy &f) {
   std::ostringstream os;
-  os << "{\n  \"functions\": [\n";
-  for (size_t i = 0; i < functions.size(); ++i) {
-    const auto &f = functions[i];
-    os << "    {\n";
-    os << "      \"functionName\": \"" << f.functionName << "\",\n";
-    os << "      \"mod\": " << f.mod << ",\n";
-    os << "      \"idMode\": \"" << f.idMode << "\",\n";
-    os << "      \"callsInOrder\": [\n";
-    for (size_t j = 0; j < f.callsInOrder.size(); ++j) {
-      const auto &c = f.callsInOrder[j];
-      os << "        {\"name\":\"" << c.name << "\",\"uniqueID\":" << c.uniqueID
-         << ",\"dummyID\":" << c.dummyID << ",\"resetCount\":" << c.resetCount
-         << ",\"irLocation\":\"" << c.irLocation << "\"}";
-      if (j + 1 < f.callsInOrder.size()) os << ",";
-      os << "\n";
+  os << "    {\n";
+  os << "      \"functionName\": \"" << f.functionName << "\",\n";
+  os << "      \"funcIndex\": " << f.funcIndex << ",\n";
+  os << "      \"funcKey\": " << f.funcKey << ",\n";
+  if (f.aliasOf >= 0) os << "      \"aliasOf\": " << f.aliasOf << ",\n";
+  os << "      \"mod\": " << f.mod << ",\n";
+  os << "      \"idMode\": \"" << f.idMode << "\",\n";
+  os << "      \"callsInOrder\": [\n";
+  for (size_t j = 0; j < f.callsInOrder.size(); ++j) {
+    const auto &c = f.callsInOrder[j];
+    os << "        {\"name\":\"" << c.name << "\",\"uniqueID\":" << c.uniqueID
+       << ",\"dummyID\":" << c.dummyID << ",\"resetCount\":" << c.resetCount
+       << ",\"irLocation\":\"" << c.irLocation << "\"}";
+    if (j + 1 < f.callsInOrder.size()) os << ",";
+    os << "\n";
+  }
+  os << "      ],\n";
+  // Graph export
+  os << "      \"nodeLabels\": [";
+  for (size_t k = 0; k < f.nodeLabels.size(); ++k) {
+    os << "\"" << f.nodeLabels[k] << "\"";
+    if (k + 1 < f.nodeLabels.size()) os << ",";
+  }
+  os << "],\n";
+  os << "      \"nodeDummyIDs\": [";
+  for (size_t k = 0; k < f.nodeDummyIDs.size(); ++k) {
+    os << f.nodeDummyIDs[k];
+    if (k + 1 < f.nodeDummyIDs.size()) os << ",";
+  }
+  os << "],\n";
+  os << "      \"nodeUniqueIDs\": [";
+  for (size_t k = 0; k < f.nodeUniqueIDs.size(); ++k) {
+    os << f.nodeUniqueIDs[k];
+    if (k + 1 < f.nodeUniqueIDs.size()) os << ",";
+  }
+  os << "],\n";
+  os << "      \"edges\": [\n";
+  for (size_t e = 0; e < f.edges.size(); ++e) {
+    const auto &E = f.edges[e];
+    os << "        {\"src\":" << E.src << ",\"dst\":" << E.dst << ",\"label\":\"" << E.label
+       << "\",\"matchDummy\":" << E.matchDummy << ",\"matchUnique\":" << E.matchUnique << "}";
+    if (e + 1 < f.edges.size()) os << ",";
+    os << "\n";
+  }
+  os << "      ],\n";
+  os << "      \"idStates\": [";
+  for (size_t k = 0; k < f.idStates.size(); ++k) {
+    const auto &IS = f.idStates[k];
+    os << "{\"id\":" << IS.id << ",\"states\":[";
+    for (size_t j = 0; j < IS.states.size(); ++j) {
+      os << IS.states[j];
+      if (j + 1 < IS.states.size()) os << ",";
     }
-    os << "      ],\n";
-    // Graph export
-    os << "      \"nodeLabels\": [";
-    for (size_t k = 0; k < f.nodeLabels.size(); ++k) {
-      os << "\"" << f.nodeLabels[k] << "\"";
-      if (k + 1 < f.nodeLabels.size()) os << ",";
+    os << "]}";
+    if (k + 1 < f.idStates.size()) os << ",";
+  }
+  os << "]";
+  if (f.checkpoints.region) {
+    const auto &CP = f.checkpoints;
+    os << ",\n      \"checkpoints\": {\"region\":" << CP.region << ",\"count\":" << CP.reach.size()
+       << ",\"start\":\"" << hexBitset(CP.start) << "\",\n        \"reach\": [";
+    for (size_t i = 0; i < CP.reach.size(); ++i) {
+      os << "\"" << hexBitset(CP.reach[i]) << "\"";
+      if (i + 1 < CP.reach.size()) os << ",";
     }
-    os << "],\n";
-    os << "      \"nodeDummyIDs\": [";
-    for (size_t k = 0; k < f.nodeDummyIDs.size(); ++k) {
-      os << f.nodeDummyIDs[k];
-      if (k + 1 < f.nodeDummyIDs.size()) os << ",";
+    os << "]}";
+  }
+  os << "\n";
+  os << "    }";
+  return os.str();
+}
+
+bool PolicyJSON::parseFunction(llvm::StringRef json, FuncPolicy &f) {
+  llvm::Expected<llvm::json::Value> V = llvm::json::parse(json);
+  if (!V) {
+    llvm::consumeError(V.takeError());
+    return false;
+  }
+  const llvm::json::Object *O = V->getAsObject();
+  return O && parseFunction(*O, f);
+}
+
+bool PolicyJSON::parseFunction(const llvm::json::Object &Fn, FuncPolicy &f) {
+  const llvm::json::Object *O = &Fn;
+  // Missing or mistyped fields read as "" / -1 (Optional vs std::optional
+  // differ across LLVM versions, so no value_or).
+  auto asStr = [](const llvm::json::Value &V) {
+    auto S = V.getAsString();
+    return S ? S->str() : std::string();
+  };
+  auto asInt = [](const llvm::json::Value &V) -> int64_t {
+    auto I = V.getAsInteger();
+    return I ? *I : -1;
+  };
+  auto str = [&](const llvm::json::Object &Obj, llvm::StringRef K) {
+    const llvm::json::Value *V = Obj.get(K);
+    return V ? asStr(*V) : std::string();
+  };
+  auto num = [&](const llvm::json::Object &Obj, llvm::StringRef K) -> int64_t {
+    const llvm::json::Value *V = Obj.get(K);
+    return V ? asInt(*V) : -1;
+  };
+  auto ints = [&](const llvm::json::Object &Obj, llvm::StringRef K, auto &out) {
+    if (const llvm::json::Array *A = Obj.getArray(K))
+      for (const llvm::json::Value &E : *A) out.push_back(asInt(E));
+  };
+
+  f = FuncPolicy();
+  f.functionName = str(*O, "functionName");
+  f.funcIndex = num(*O, "funcIndex");
+  f.funcKey = num(*O, "funcKey");
+  f.aliasOf = num(*O, "aliasOf");
+  f.mod = num(*O, "mod");
+  f.idMode = str(*O, "idMode");
+  if (const llvm::json::Array *A = O->getArray("callsInOrder")) {
+    for (const llvm::json::Value &E : *A) {
+      const llvm::json::Object *C = E.getAsObject();
+      if (!C) return false;
+      f.callsInOrder.push_back({str(*C, "name"), (int)num(*C, "uniqueID"), (int)num(*C, "dummyID"),
+                                (int)num(*C, "resetCount"), str(*C, "irLocation")});
     }
-    os << "],\n";
-    os << "      \"nodeUniqueIDs\": [";
-    for (size_t k = 0; k < f.nodeUniqueIDs.size(); ++k) {
-      os << f.nodeUniqueIDs[k];
-      if (k + 1 < f.nodeUniqueIDs.size()) os << ",";
+  }
+  if (const llvm::json::Array *A = O->getArray("nodeLabels"))
+    for (const llvm::json::Value &E : *A) f.nodeLabels.push_back(asStr(E));
+  ints(*O, "nodeDummyIDs", f.nodeDummyIDs);
+  ints(*O, "nodeUniqueIDs", f.nodeUniqueIDs);
+  if (const llvm::json::Array *A = O->getArray("edges")) {
+    for (const llvm::json::Value &E : *A) {
+      const llvm::json::Object *Ed = E.getAsObject();
+      if (!Ed) return false;
+      int64_t src = num(*Ed, "src"), dst = num(*Ed, "dst");
+      if (src < 0 || dst < 0) return false;
+      f.edges.push_back({(size_t)src, (size_t)dst, str(*Ed, "label"),
+                         (int)num(*Ed, "matchDummy"), (int)num(*Ed, "matchUnique")});
     }
-    os << "],\n";
-    os << "      \"edges\": [\n";
-    for (size_t e = 0; e < f.edges.size(); ++e) {
-      const auto &E = f.edges[e];
-      os << "        {\"src\":" << E.src << ",\"dst\":" << E.dst << ",\"label\":\"" << E.label
-         << "\",\"matchDummy\":" << E.matchDummy << ",\"matchUnique\":" << E.matchUnique << "}";
-      if (e + 1 < f.edges.size()) os << ",";
-      os << "\n";
+  }
+  if (const llvm::json::Array *A = O->getArray("idStates")) {
+    for (const llvm::json::Value &E : *A) {
+      const llvm::json::Object *I = E.getAsObject();
+      if (!I) return false;
+      FuncPolicy::IDStates IS;
+      IS.id = num(*I, "id");
+      ints(*I, "states", IS.states);
+      f.idStates.push_back(std::move(IS));
     }
-    os << "      ]\n";
-    os << "    }";
-    if (i + 1 < functions.size()) os << ",";
-    os << "\n";
   }
-  os << "  ]\n}\n";
-  return os.str();
+  if (const llvm::json::Object *C = O->getObject("checkpoints")) {
+    int64_t count = num(*C, "count");
+    const llvm::json::Array *A = C->getArray("reach");
+    if (count < 0 || count > MaxCheckpoints || !A || A->size() != (size_t)count)
+      return false;
+    f.checkpoints.region = num(*C, "region");
+    if (!parseHexBitset(str(*C, "start"), count, f.checkpoints.start)) return false;
+    f.checkpoints.reach.resize(count);
+    for (size_t i = 0; i < A->size(); ++i) {
+      auto S = (*A)[i].getAsString();
+      if (!S || !parseHexBitset(*S, count, f.checkpoints.reach[i])) return false;
+    }
+  }
+  return f.nodeLabels.size() == f.nodeDummyIDs.size() &&
+         f.nodeLabels.size() == f.nodeUniqueIDs.size();
 }
@@ -1,10 +1,22 @@
 
 #include "Policy/LibCallGraph.h"
+#include "Policy/PolicyBinary.h"
+#include "Policy/PolicyCache.h"
+#include "Policy/PolicyCxxEmitter.h"
+#include "Policy/PolicyReport.h"
 
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
@@ -17,17 +29,46 @@
 #include "llvm/IR/CFG.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <numeric>
 #include <set>
 #include <map>
+#include <memory>
 
 using namespace llvm;
 using namespace policy;
 
+#define DEBUG_TYPE "libcall"
+
+// Always enabled so -stats works against release builds of opt/clang/lld.
+// Graph counters cover analyzed functions only (cache hits skip the graph).
+ALWAYS_ENABLED_STATISTIC(NumSitesInstrumented, "Number of dummy() calls inserted");
+ALWAYS_ENABLED_STATISTIC(NumNodes, "Number of automaton nodes built");
+ALWAYS_ENABLED_STATISTIC(NumEdges, "Number of automaton edges built");
+ALWAYS_ENABLED_STATISTIC(NumEpsilonEdges, "Number of epsilon edges built");
+ALWAYS_ENABLED_STATISTIC(NumBytesEmitted, "Bytes of DOT and policy JSON written");
+ALWAYS_ENABLED_STATISTIC(NumCacheHits, "Functions served from the result cache");
+ALWAYS_ENABLED_STATISTIC(NumCacheMisses, "Functions analyzed on a cache miss");
+ALWAYS_ENABLED_STATISTIC(NumHotBlocks, "Hot blocks whose libcalls share one event");
+ALWAYS_ENABLED_STATISTIC(NumSitesCoalesced, "Libcalls covered by an earlier event in a hot block");
+ALWAYS_ENABLED_STATISTIC(NumCheckpoints, "Checkpoint events inserted");
+ALWAYS_ENABLED_STATISTIC(NumSitesBetweenCheckpoints, "Libcalls left silent between checkpoints");
+ALWAYS_ENABLED_STATISTIC(NumSitesElided, "Hot libcalls whose event the previous event implies");
+
 static cl::opt<std::string> DotOutDir(
     "libcall-dot-dir",
     cl::desc("Directory to emit per-function DOT graphs"),
@@ -45,9 +86,127 @@ static cl::opt<unsigned> HashMod(
 
 static cl::opt<std::string> IdModeOpt(
     "libcall-id-mode",
-    cl::desc("ID mode: unique or dummy"),
+    cl::desc("ID mode: unique, dummy or global (64-bit function key << 32 | site)"),
     cl::init("dummy"));
 
+static cl::opt<std::string> CxxHeaderOut(
+    "libcall-cxx-header",
+    cl::desc("Also write the policy as a C++17 header (constexpr tables and a "
+             "std::bitset checker per function)"),
+    cl::init(""));
+
+static cl::opt<std::string> ReportOut(
+    "libcall-report",
+    cl::desc("Also write a per-function cost report (states, frontier and DFA "
+             "bounds, kernel memory per engine) as JSON"),
+    cl::init(""));
+
+static cl::opt<bool> EmbedPolicy(
+    "libcall-embed",
+    cl::desc("Embed the module's policy as an LCPB image in the .libcall_policy "
+             "section, so sandboxctl -e can load it from the executable"),
+    cl::init(false));
+
+static cl::opt<std::string> CacheDir(
+    "libcall-cache-dir",
+    cl::desc("Directory for the per-function result cache (empty disables it)"),
+    cl::init(""));
+
+static cl::opt<bool> EmitDOTOpt(
+    "libcall-emit-dot",
+    cl::desc("Emit a DOT graph per function into -libcall-dot-dir"),
+    cl::init(false));
+
+static cl::opt<std::string> DotFilterOpt(
+    "libcall-dot-filter",
+    cl::desc("Only emit DOT for functions matching this regex (implies -libcall-emit-dot)"),
+    cl::init(""));
+
+static cl::opt<unsigned> DotThreads(
+    "libcall-dot-threads",
+    cl::desc("Threads writing DOT files (0 = all cores)"),
+    cl::init(0));
+
+enum class EmitMode { Call, Syscall };
+
+static cl::opt<EmitMode> EmitModeOpt(
+    "libcall-emit",
+    cl::desc("How instrumented sites raise the dummy event"),
+    cl::values(clEnumValN(EmitMode::Call, "call", "call void @dummy(i32) (@dummy64(i64) for global IDs) from libdummy"),
+               clEnumValN(EmitMode::Syscall, "syscall", "inline syscall instruction (x86-64)")),
+    cl::init(EmitMode::Call));
+
+static cl::opt<unsigned> SyscallNr(
+    "libcall-syscall-nr",
+    cl::desc("Dummy syscall number for -libcall-emit=syscall (libdummy's __NR_dummy)"),
+    cl::init(451));
+
+enum class LTOMode { None, Full, Thin };
+
+static cl::opt<LTOMode> LTOModeOpt(
+    "libcall-lto",
+    cl::desc("Run the pass at link time (pass via -Wl,-mllvm,...)"),
+    cl::values(clEnumValN(LTOMode::None, "none", "only via -passes=libcall"),
+               clEnumValN(LTOMode::Full, "full", "full-LTO link (LLVM 15+)"),
+               clEnumValN(LTOMode::Thin, "thin", "each ThinLTO backend")),
+    cl::init(LTOMode::None)
+#if LLVM_VERSION_MAJOR < 15
+    // No full-LTO extension point to register with: fail the link instead of
+    // producing an uninstrumented binary without a policy
+    , cl::callback([](const LTOMode &Mode) {
+        if (Mode != LTOMode::Full) return;
+        errs() << "libcall: -libcall-lto=full needs LLVM 15 or later; with LLVM "
+               << LLVM_VERSION_MAJOR << " use -Wl,--lto-newpm-passes=default<O2>,libcall\n";
+        exit(1);
+      })
+#endif
+    );
+
+// Off by default: -flto compiles run the OptimizerLast callbacks in their
+// pre-link pipelines, and instrumenting there would mark every function
+// libcall-instrumented before the link-time run sees the whole program.
+static cl::opt<bool> LateInstrument(
+    "libcall-late",
+    cl::desc("Instrument at the end of the optimization pipeline when the plugin "
+             "is loaded into a default pipeline (clang -fpass-plugin); leave off "
+             "for -flto compiles"),
+    cl::init(false));
+
+static cl::opt<bool> UseBFI(
+    "libcall-bfi",
+    cl::desc("Use block frequencies (and PGO profiles when present) to raise one "
+             "event per hot block instead of one per libcall"),
+    cl::init(false));
+
+static cl::opt<unsigned> HotRatio(
+    "libcall-hot-ratio",
+    cl::desc("With -libcall-bfi, a block is hot when it runs at least this many "
+             "times per function entry"),
+    cl::init(8));
+
+static cl::opt<unsigned> Checkpoints(
+    "libcall-checkpoints",
+    cl::desc("Raise events only at checkpoints, at most this many libcalls apart "
+             "on any path (loop headers always start a new region); 0 = every call"),
+    cl::init(0));
+
+static cl::opt<std::string> SiteProfile(
+    "libcall-site-profile",
+    cl::desc("Per-site event counts from a previous run ('<count> <event-id>' or "
+             "'<count> <function> <site>' lines); hot sites are coalesced or elided "
+             "and hot states numbered first"),
+    cl::init(""));
+
+static cl::opt<unsigned> ProfileHotShare(
+    "libcall-profile-hot",
+    cl::desc("With -libcall-site-profile, a site is hot when it raises at least this "
+             "percentage of its function's events"),
+    cl::init(5));
+
+// Marks functions that already carry dummy() calls, so a module that went
+// through the pass at compile time is not instrumented again at link time.
+static const char InstrumentedAttr[] = "libcall-instrumented";
+
 namespace {
 
 struct LibCallPass : public PassInfoMixin<LibCallPass> {
@@ -61,196 +220,804 @@ struct LibCallPass : public PassInfoMixin<LibCallPass> {
     return true;
   }
 
+  // Global IDs index the site within the function and carry the function
+  // key in the upper 32 bits, so one ID space covers the whole program.
+  static bool globalIDs() { return IdModeOpt == "global"; }
+  static bool siteIDs() { return idMode() != "dummy"; }
+
+  // Checkpoint IDs index the reachability relation, so they must not wrap:
+  // with -libcall-checkpoints the dummy mode falls back to unique IDs.
+  static StringRef idMode() {
+    return Checkpoints && IdModeOpt == "dummy" ? StringRef("unique") : StringRef(IdModeOpt);
+  }
+
+  // A site profile names sites by their call ordinal in the function, so with
+  // one every call keeps its ordinal as ID, raised or not, and the profile of
+  // this build lines up with the next. Checkpoint IDs are dense checkpoint
+  // indices, so checkpoint mode ignores the profile.
+  static bool profileIDs() { return !SiteProfile.empty() && !Checkpoints; }
+
+  // dummy(int), or dummy64(uint64_t) for global IDs
   static Function *getOrInsertDummyDecl(Module &M) {
     LLVMContext &Ctx = M.getContext();
     auto *VoidTy = Type::getVoidTy(Ctx);
-    auto *IntTy  = Type::getInt32Ty(Ctx);
+    auto *IntTy  = globalIDs() ? Type::getInt64Ty(Ctx) : Type::getInt32Ty(Ctx);
     auto *FTy = FunctionType::get(VoidTy, {IntTy}, /*isVarArg=*/false);
-    FunctionCallee FC = M.getOrInsertFunction("dummy", FTy);
+    FunctionCallee FC = M.getOrInsertFunction(globalIDs() ? "dummy64" : "dummy", FTy);
     if (Function *F = dyn_cast<Function>(FC.getCallee())) {
       F->setCallingConv(CallingConv::C);
+      addEventAttrs(*F);
       return F;
     }
     return nullptr;
   }
 
+  // An event never unwinds and touches no memory the program can see: the
+  // inline syscall touches none, and libdummy's dummy() restores the errno
+  // its syscall() may set (a replacement dummy() must do the same). So code
+  // around an event keeps its loads/stores in registers. It is not
+  // willreturn (the kernel may kill the process), which also keeps the
+  // optimizer from deleting events when the pass runs before late passes.
+  template <typename T> static void addEventAttrs(T &FnOrCall) {
+    FnOrCall.addFnAttr(Attribute::NoUnwind);
+#if LLVM_VERSION_MAJOR >= 16
+    FnOrCall.setMemoryEffects(MemoryEffects::inaccessibleMemOnly());
+#else
+    FnOrCall.addFnAttr(Attribute::InaccessibleMemOnly);
+#endif
+  }
+
+  // How an event reaches the kernel: a call to libdummy's dummy(int) /
+  // dummy64(uint64_t), or the syscall instruction itself as inline asm.
+  struct EventSink {
+    Function *DummyDecl = nullptr;
+    InlineAsm *Syscall = nullptr;
+
+    void emit(IRBuilder<> &B, uint64_t ID) const {
+      if (Syscall) {
+        addEventAttrs(*B.CreateCall(Syscall, {B.getInt64(SyscallNr), B.getInt64(ID)}));
+        return;
+      }
+      Type *IdTy = DummyDecl->getFunctionType()->getParamType(0);
+      B.CreateCall(DummyDecl, {ConstantInt::get(IdTy, ID)});
+    }
+  };
+
+  static EventSink makeEventSink(Module &M) {
+    EventSink S;
+    if (EmitModeOpt == EmitMode::Syscall) {
+      if (Triple(M.getTargetTriple()).getArch() == Triple::x86_64) {
+        // rax = number in, return value out; rdi = id. The instruction
+        // itself overwrites rcx and r11. No memory clobber: the dummy
+        // syscall reads no user memory, and sideeffect keeps it ordered.
+        auto *I64 = Type::getInt64Ty(M.getContext());
+        auto *FTy = FunctionType::get(I64, {I64, I64}, /*isVarArg=*/false);
+        S.Syscall = InlineAsm::get(
+            FTy, "syscall", "={ax},0,{di},~{rcx},~{r11},~{dirflag},~{fpsr},~{flags}",
+            /*hasSideEffects=*/true);
+        return S;
+      }
+      errs() << "libcall: -libcall-emit=syscall needs an x86-64 target; using dummy() calls in "
+             << M.getModuleIdentifier() << "\n";
+    }
+    S.DummyDecl = getOrInsertDummyDecl(M);
+    return S;
+  }
+
+  // Link-stable function identity for global IDs: the symbol name's hash,
+  // salted with the module for local symbols (which may repeat across TUs).
+  // Every TU computes the same key for a function, so per-TU policies merge
+  // without touching the compiled events (see libcall-link).
+  static uint32_t functionKey(const Function &F) {
+    MD5 Hasher;
+    if (F.hasLocalLinkage()) {
+      Hasher.update(F.getParent()->getModuleIdentifier());
+      Hasher.update(ArrayRef<uint8_t>{0});
+    }
+    Hasher.update(F.getName());
+    MD5::MD5Result Res;
+    Hasher.final(Res);
+    return static_cast<uint32_t>(Res.low());
+  }
+
+  // Event counts per site (call ordinal, from 1), keyed by function key for
+  // global event IDs and by function name otherwise.
+  struct SiteCounts {
+    std::map<uint32_t, std::map<unsigned, uint64_t>> byKey;
+    std::map<std::string, std::map<unsigned, uint64_t>> byName;
+
+    const std::map<unsigned, uint64_t> *lookup(const Function &F, uint32_t funcKey) const {
+      auto K = byKey.find(funcKey);
+      if (K != byKey.end()) return &K->second;
+      auto N = byName.find(F.getName().str());
+      return N != byName.end() ? &N->second : nullptr;
+    }
+  };
+
+  // One site per line: "<count> <event-id>" for global IDs (a `uniq -c` of
+  // the raised IDs) or "<count> <function> <site>". Counts for the same site
+  // add up; '#' starts a comment.
+  static SiteCounts loadSiteProfile(StringRef Path) {
+    SiteCounts Counts;
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+      errs() << "libcall: cannot read site profile " << Path << ": " << Buf.getError().message() << "\n";
+      return Counts;
+    }
+    for (line_iterator L(**Buf, /*SkipBlanks=*/true, '#'); !L.is_at_eof(); ++L) {
+      SmallVector<StringRef, 3> Fields;
+      SplitString(*L, Fields);
+      uint64_t Count = 0, ID = 0;
+      bool Ok = Fields.size() >= 2 && Fields.size() <= 3 && !Fields[0].getAsInteger(10, Count) &&
+                !Fields.back().getAsInteger(0, ID);
+      if (Ok && Fields.size() == 2)
+        Counts.byKey[ID >> 32][ID & 0xffffffffu] += Count;
+      else if (Ok && ID <= UINT_MAX)
+        Counts.byName[Fields[1].str()][ID] += Count;
+      else
+        errs() << "libcall: " << Path << ":" << L.line_number() << ": ignoring malformed line\n";
+    }
+    return Counts;
+  }
+
   struct BBCallList {
+    const BasicBlock *BB = nullptr;
     SmallVector<std::pair<Instruction*, CallBase*>, 4> calls;
     size_t entryNode = SIZE_MAX;
     size_t exitNode  = SIZE_MAX;
+    bool coalesce = false; // hot: one node and one event for all calls
+    bool elided = false;   // hot and implied by the previous event: no node, no event
+    uint64_t count = 0;    // profiled events (hottest call of the block)
+    SmallVector<unsigned, 2> checkpoints; // call indices raising events (checkpoint mode)
+
+    // Calls that raise their own event (the first call of a coalesced run)
+    unsigned events() const { return elided ? 0 : coalesce ? 1 : calls.size(); }
+    bool raisesEvent(unsigned c) const {
+      if (c >= events()) return false;
+      return !Checkpoints || is_contained(checkpoints, c);
+    }
   };
 
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-    sys::fs::create_directories(DotOutDir);
-    Function *DummyDecl = getOrInsertDummyDecl(M);
-    PolicyJSON policyOut;
+  // With -libcall-bfi, blocks at least HotRatio times as frequent as the entry
+  // get a single event for their whole libcall run. BFI reads branch weights,
+  // so PGO profiles sharpen the choice without extra handling.
+  static void markHotBlocks(std::vector<BBCallList> &blocks, BlockFrequencyInfo &BFI) {
+    uint64_t Entry = BFI.getEntryFreq();
+    if (!Entry) return;
+    for (auto &lst : blocks) {
+      if (lst.calls.size() < 2) continue;
+      uint64_t Freq = BFI.getBlockFreq(lst.BB).getFrequency();
+      if (Freq / Entry < HotRatio) continue;
+      lst.coalesce = true;
+      ++NumHotBlocks;
+    }
+  }
 
-    std::map<Function*, unsigned> uniqueIdCounterPerFunc;
-    std::map<Function*, unsigned> dummyCounterPerFunc;
+  // Pretty name of a coalesced block's node: its callees joined by '+'.
+  static std::string coalescedLabel(const BBCallList &lst) {
+    std::string label;
+    for (auto &pr : lst.calls) {
+      if (!label.empty()) label += '+';
+      label += pr.second->getCalledFunction()->getName();
+    }
+    return label;
+  }
 
-    for (Function &F : M) {
-      if (F.isDeclaration()) continue;
+  // With -libcall-site-profile, blocks whose hottest call raises at least
+  // ProfileHotShare percent of the function's events are coalesced like BFI
+  // hot blocks. A hot block is elided altogether when its event carries no
+  // information: exactly one observed block can precede it, that block can be
+  // followed by nothing else (nor return), and the function cannot start
+  // there. Dropping the event only merges two states that always follow one
+  // another, so the automaton accepts the same paths.
+  static void markProfiledBlocks(std::vector<BBCallList> &blocks,
+                                 const std::map<const BasicBlock*, size_t> &blockOf,
+                                 const std::map<unsigned, uint64_t> &counts) {
+    uint64_t Total = 0;
+    for (auto &pr : counts) Total += pr.second;
+    if (!Total) return;
+    unsigned ordinal = 0;
+    for (auto &lst : blocks) {
+      for (size_t c = 0; c < lst.calls.size(); ++c) {
+        auto It = counts.find(++ordinal);
+        if (It != counts.end()) lst.count = std::max(lst.count, It->second);
+      }
+    }
 
-      Graph G;
-      G.functionName = std::string(F.getName());
-      G.initBuckets(HashMod);
+    std::vector<size_t> hot;
+    for (size_t b = 0; b < blocks.size(); ++b)
+      if (blocks[b].count && blocks[b].count * 100 >= (uint64_t)ProfileHotShare * Total)
+        hot.push_back(b);
+    std::stable_sort(hot.begin(), hot.end(),
+                     [&](size_t x, size_t y) { return blocks[x].count > blocks[y].count; });
 
-      std::map<const BasicBlock*, BBCallList> bbMap;
+    auto observed = [&](size_t s) { return blocks[s].events() > 0; };
+    for (size_t b : hot) {
+      auto &lst = blocks[b];
+      if (lst.calls.size() > 1 && !lst.coalesce) {
+        lst.coalesce = true;
+        ++NumHotBlocks;
+      }
+      // Observed blocks that can precede b, looking back through silent ones
+      std::vector<bool> seen(blocks.size());
+      std::vector<size_t> queue{b};
+      SmallVector<size_t, 2> preds;
+      bool start = false;
+      for (size_t i = 0; i < queue.size(); ++i) {
+        const BasicBlock *BB = blocks[queue[i]].BB;
+        if (BB->isEntryBlock()) start = true;
+        for (const BasicBlock *Pred : predecessors(BB)) {
+          size_t p = blockOf.at(Pred);
+          if (seen[p]) continue;
+          seen[p] = true;
+          if (observed(p)) preds.push_back(p);
+          else queue.push_back(p);
+        }
+      }
+      if (start || preds.size() != 1 || preds.front() == b) continue;
+      unsigned next = 0;
+      bool exits = walkToStops(blocks, blockOf, preds.front(), /*inclusive=*/false, observed,
+                               [&](size_t) { ++next; });
+      if (!exits && next == 1) lst.elided = true;
+    }
+  }
 
-      for (BasicBlock &BB : F) {
-        BBCallList lst;
-        for (Instruction &I : BB) {
-          if (auto *CB = dyn_cast<CallBase>(&I)) {
-            if (isCandidateLibCall(*CB)) {
-              lst.calls.emplace_back(&I, CB);
-            }
+  // Blocks in node numbering order: layout order, or hottest first with a
+  // profile, so the states most events land on sit together in the kernel's
+  // tables and frontier bitsets.
+  static std::vector<size_t> nodeOrder(const std::vector<BBCallList> &blocks) {
+    std::vector<size_t> order(blocks.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t x, size_t y) { return blocks[x].count > blocks[y].count; });
+    return order;
+  }
+
+  // Candidate libcalls per basic block, in function layout order. Iterating
+  // this (rather than a pointer-keyed map) keeps node numbering stable.
+  static std::vector<BBCallList> collectCalls(Function &F) {
+    std::vector<BBCallList> blocks;
+    for (BasicBlock &BB : F) {
+      BBCallList lst;
+      lst.BB = &BB;
+      for (Instruction &I : BB) {
+        if (auto *CB = dyn_cast<CallBase>(&I)) {
+          if (isCandidateLibCall(*CB)) {
+            lst.calls.emplace_back(&I, CB);
           }
         }
-        bbMap[&BB] = std::move(lst);
       }
+      blocks.push_back(std::move(lst));
+    }
+    return blocks;
+  }
 
-      std::map<Instruction*, size_t> callNodeIndex;
-      for (auto &kv : bbMap) {
-        auto &lst = kv.second;
-        for (auto &pr : lst.calls) {
-          CallBase *CB = pr.second;
-          std::string pretty = CB->getCalledFunction()->getName().str();
-          size_t idx = G.addNodeRetIndex(pretty);
-          callNodeIndex[pr.first] = idx;
-        }
+  // Hash of everything the per-function results depend on: options, the
+  // block structure, the libcall sequence per block and its debug lines.
+  static std::string hashFunction(const Function &F, unsigned funcIndex, uint32_t funcKey,
+                                  const std::vector<BBCallList> &blocks) {
+    std::map<const BasicBlock*, unsigned> bbIndex;
+    for (size_t i = 0; i < blocks.size(); ++i) bbIndex[blocks[i].BB] = i;
+
+    MD5 Hasher;
+    auto addInt = [&](uint64_t V) {
+      Hasher.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&V), sizeof(V)));
+    };
+    Hasher.update("libcall-cache-v6");
+    Hasher.update(IdModeOpt);
+    addInt(HashMod);
+    addInt(Checkpoints);
+    addInt(profileIDs());
+    Hasher.update(F.getName());
+    addInt(funcIndex);
+    addInt(funcKey);
+    addInt(blocks.size());
+    for (const auto &lst : blocks) {
+      addInt(lst.calls.size());
+      addInt(lst.coalesce);
+      addInt(lst.elided);
+      addInt(lst.count);
+      addInt(lst.checkpoints.size());
+      for (unsigned c : lst.checkpoints) addInt(c);
+      for (auto &pr : lst.calls) {
+        Hasher.update(pr.second->getCalledFunction()->getName());
+        addInt(pr.first->getDebugLoc() ? pr.first->getDebugLoc().getLine() : 0);
       }
+      addInt(succ_size(lst.BB));
+      for (const BasicBlock *Succ : successors(lst.BB)) addInt(bbIndex[Succ]);
+    }
+    MD5::MD5Result Res;
+    Hasher.final(Res);
+    SmallString<32> Hex;
+    MD5::stringifyResult(Res, Hex);
+    return std::string(Hex);
+  }
 
-      for (auto &kv : bbMap) {
-        const BasicBlock *BB = kv.first;
-        auto &lst = kv.second;
-        if (!lst.calls.empty()) {
-          lst.entryNode = callNodeIndex[lst.calls.front().first];
-          lst.exitNode  = callNodeIndex[lst.calls.back().first];
-        }
-        for (size_t i = 0; i + 1 < lst.calls.size(); ++i) {
-          auto *CB1 = lst.calls[i].second;
-          auto *CB2 = lst.calls[i+1].second;
-          size_t n1 = callNodeIndex[lst.calls[i].first];
-          size_t n2 = callNodeIndex[lst.calls[i+1].first];
-          std::string label = CB1->getCalledFunction()->getName().str();
-          G.addEdge(n1, n2, label);
-        }
-        if (!lst.calls.empty()) {
-          for (const BasicBlock *Succ : successors(BB)) {
-            auto it = bbMap.find(Succ);
-            if (it != bbMap.end() && !it->second.calls.empty()) {
-              size_t src = lst.exitNode;
-              size_t dst = it->second.entryNode;
-              G.addEdge(src, dst, "ϵ");
-            }
-          }
+  static std::map<const BasicBlock*, size_t> indexBlocks(const std::vector<BBCallList> &blocks) {
+    std::map<const BasicBlock*, size_t> blockOf;
+    for (size_t b = 0; b < blocks.size(); ++b) blockOf[blocks[b].BB] = b;
+    return blockOf;
+  }
+
+  // Breadth-first walk from `from` (its successors unless `inclusive`) that
+  // stops at blocks where `stop` holds and reports each of them once, in
+  // successor order. Returns whether a return is reachable without stopping.
+  static bool walkToStops(const std::vector<BBCallList> &blocks,
+                          const std::map<const BasicBlock*, size_t> &blockOf,
+                          size_t from, bool inclusive,
+                          function_ref<bool(size_t)> stop,
+                          function_ref<void(size_t)> onStop) {
+    std::vector<bool> seen(blocks.size());
+    std::vector<size_t> queue;
+    bool exits = false;
+    auto enterSuccessors = [&](size_t b) {
+      const BasicBlock *BB = blocks[b].BB;
+      if (isa<ReturnInst>(BB->getTerminator())) exits = true;
+      for (const BasicBlock *Succ : successors(BB)) queue.push_back(blockOf.at(Succ));
+    };
+    if (inclusive) queue.push_back(from);
+    else enterSuccessors(from);
+    for (size_t i = 0; i < queue.size(); ++i) {
+      size_t b = queue[i];
+      if (seen[b]) continue;
+      seen[b] = true;
+      if (stop(b)) {
+        onStop(b);
+        continue;
+      }
+      enterSuccessors(b);
+    }
+    return exits;
+  }
+
+  // Checkpoint placement over reverse post-order. `dist` is the size of the
+  // current region (events since the last checkpoint, inclusive) on the
+  // longest incoming path; a region ends once it holds `Checkpoints` events.
+  // The entry and loop headers (targets of back edges) start a new region,
+  // so every cycle contains a checkpoint.
+  static void selectCheckpoints(Function &F, std::vector<BBCallList> &blocks,
+                                const std::map<const BasicBlock*, size_t> &blockOf) {
+    unsigned K = Checkpoints;
+    std::vector<unsigned> rpo(blocks.size(), UINT_MAX), dist(blocks.size(), 0);
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    unsigned order = 0;
+    for (BasicBlock *BB : RPOT) rpo[blockOf.at(BB)] = order++;
+    for (BasicBlock *BB : RPOT) {
+      size_t b = blockOf.at(BB);
+      unsigned d = BB->isEntryBlock() ? K : 0;
+      for (const BasicBlock *Pred : predecessors(BB)) {
+        size_t p = blockOf.at(Pred);
+        if (rpo[p] >= rpo[b]) d = K; // back edge
+        else d = std::max(d, dist[p]);
+      }
+      auto &lst = blocks[b];
+      for (unsigned c = 0; c < lst.events(); ++c) {
+        if (d >= K) {
+          lst.checkpoints.push_back(c);
+          d = 1;
+        } else {
+          ++d;
         }
       }
+      dist[b] = d;
+    }
+  }
 
-      PolicyJSON::FuncPolicy funcPol;
-      funcPol.functionName = G.functionName;
-      funcPol.mod = HashMod;
-      funcPol.idMode = IdModeOpt;
+  // Checkpoint-to-checkpoint relation: checkpoint i may be followed by j if
+  // j is the next checkpoint on some path from i. Checkpoints from which the
+  // function can return may be followed by a first checkpoint again, so
+  // repeated calls of the function are accepted.
+  static void exportCheckpoints(const std::vector<BBCallList> &blocks,
+                                const std::map<const BasicBlock*, size_t> &blockOf,
+                                PolicyJSON::FuncPolicy &funcPol) {
+    std::vector<unsigned> firstOrdinal(blocks.size(), UINT_MAX);
+    unsigned C = 0;
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      if (!blocks[b].checkpoints.empty()) firstOrdinal[b] = C;
+      C += blocks[b].checkpoints.size();
+    }
+    auto hasCheckpoint = [&](size_t b) { return !blocks[b].checkpoints.empty(); };
 
-      for (BasicBlock &BB : F) {
-        for (Instruction &I : BB) {
-          auto *CB = dyn_cast<CallBase>(&I);
-          if (!CB || !isCandidateLibCall(*CB)) continue;
+    auto &Out = funcPol.checkpoints;
+    Out.region = Checkpoints;
+    Out.start.resize(C);
+    walkToStops(blocks, blockOf, 0, /*inclusive=*/true, hasCheckpoint,
+                [&](size_t s) { Out.start.set(firstOrdinal[s]); });
+    Out.reach.assign(C, BitVector(C));
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      unsigned n = blocks[b].checkpoints.size();
+      for (unsigned k = 0; k + 1 < n; ++k)
+        Out.reach[firstOrdinal[b] + k].set(firstOrdinal[b] + k + 1);
+      if (!n) continue;
+      BitVector &Last = Out.reach[firstOrdinal[b] + n - 1];
+      bool exits = walkToStops(blocks, blockOf, b, /*inclusive=*/false, hasCheckpoint,
+                               [&](size_t s) { Last.set(firstOrdinal[s]); });
+      if (exits) Last |= Out.start;
+    }
+  }
 
-          unsigned uniqueID = ++uniqueIdCounterPerFunc[&F];
-          unsigned &dc = dummyCounterPerFunc[&F];
-          unsigned reset = dc / HashMod;
-          unsigned dummyID = dc % HashMod;
-          ++dc;
+  static void buildGraph(Graph &G, std::vector<BBCallList> &blocks,
+                         const std::map<const BasicBlock*, size_t> &blockOf,
+                         std::map<Instruction*, size_t> &callNodeIndex) {
+    TimeTraceScope Scope("LibCallBuildGraph", G.functionName);
+    for (size_t b : nodeOrder(blocks)) {
+      auto &lst = blocks[b];
+      if (lst.elided) continue;
+      if (lst.coalesce) {
+        lst.entryNode = lst.exitNode = G.addNode(coalescedLabel(lst));
+        callNodeIndex[lst.calls.front().first] = lst.entryNode;
+        continue;
+      }
+      for (auto &pr : lst.calls) {
+        CallBase *CB = pr.second;
+        size_t idx = G.addNode(CB->getCalledFunction()->getName());
+        callNodeIndex[pr.first] = idx;
+      }
+      if (!lst.calls.empty()) {
+        lst.entryNode = callNodeIndex[lst.calls.front().first];
+        lst.exitNode  = callNodeIndex[lst.calls.back().first];
+      }
+    }
 
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      auto &lst = blocks[b];
+      for (size_t i = 0; i + 1 < lst.events(); ++i) {
+        auto *CB1 = lst.calls[i].second;
+        size_t n1 = callNodeIndex[lst.calls[i].first];
+        size_t n2 = callNodeIndex[lst.calls[i+1].first];
+        G.addEdge(n1, n2, CB1->getCalledFunction()->getName());
+      }
+      // ϵ-edges to the next calls, looking through blocks without events
+      if (lst.events()) {
+        walkToStops(
+            blocks, blockOf, b, /*inclusive=*/false,
+            [&](size_t s) { return blocks[s].events() > 0; },
+            [&](size_t s) {
+              G.addEdge(lst.exitNode, blocks[s].entryNode, "ϵ");
+              ++NumEpsilonEdges;
+            });
+      }
+    }
+    G.freeze();
+    NumNodes += G.numNodes();
+    NumEdges += G.numEdges();
+  }
+
+  // Insert a dummy event before every libcall. When `G` is null (cache hit) only
+  // the IR is rewritten; IDs depend solely on call order, so they match the
+  // cached policy.
+  static void instrumentFunction(Function &F, uint32_t funcKey,
+                                 const std::vector<BBCallList> &blocks,
+                                 const EventSink &Sink, Graph *G,
+                                 const std::map<Instruction*, size_t> &callNodeIndex,
+                                 PolicyJSON::FuncPolicy *funcPol) {
+    TimeTraceScope Scope("LibCallAssignIDs", F.getName());
+    unsigned uniqueCounter = 0;
+    unsigned dc = 0;
+    unsigned ordinal = 0;
+    for (const auto &lst : blocks) {
+      for (size_t c = 0; c < lst.calls.size(); ++c, ++ordinal) {
+        // A hot block's first call raises the event for the whole run;
+        // in checkpoint mode only checkpoints raise one
+        if (!lst.raisesEvent(c)) {
+          if (lst.elided) ++NumSitesElided;
+          else if (c >= lst.events()) ++NumSitesCoalesced;
+          else ++NumSitesBetweenCheckpoints;
+          continue;
+        }
+        if (Checkpoints) ++NumCheckpoints;
+        Instruction &I = *lst.calls[c].first;
+        CallBase *CB = lst.calls[c].second;
+
+        unsigned uniqueID = profileIDs() ? ordinal + 1 : ++uniqueCounter;
+        unsigned counter = profileIDs() ? ordinal : dc++;
+        unsigned reset = counter / HashMod;
+        unsigned dummyID = counter % HashMod;
+
+        if (G) {
           auto itNode = callNodeIndex.find(&I);
           if (itNode != callNodeIndex.end()) {
             auto idx = itNode->second;
-            G.nodes[idx].dummyID = static_cast<int>(dummyID);
-            G.nodes[idx].uniqueID = static_cast<int>(uniqueID);
-            G.insertIntoBuckets(idx, dummyID);
+            G->setIDs(idx, static_cast<int>(dummyID), static_cast<int>(uniqueID));
+            G->insertIntoBuckets(idx, siteIDs() ? (int)uniqueID : (int)dummyID);
           }
+        }
 
-          IRBuilder<> B(&I);
-          Value *Arg = nullptr;
-          if (IdModeOpt == "unique") {
-            Arg = B.getInt32(uniqueID);
-          } else {
-            Arg = B.getInt32(dummyID);
-          }
-          B.CreateCall(DummyDecl, {Arg});
+        IRBuilder<> B(&I);
+        if (globalIDs())
+          Sink.emit(B, (uint64_t)funcKey << 32 | uniqueID);
+        else
+          Sink.emit(B, siteIDs() ? uniqueID : dummyID);
+        ++NumSitesInstrumented;
 
-          std::string loc = "unknown";
-          if (I.getDebugLoc()) {
-            auto DL = I.getDebugLoc();
-            loc = (Twine("line ") + Twine(DL.getLine())).str();
-          }
-          PolicyJSON::LibCallSite site;
-          site.name = CB->getCalledFunction()->getName().str();
-          site.uniqueID = (IdModeOpt == "unique") ? (int)uniqueID : -1;
-          site.dummyID = (int)dummyID;
-          site.resetCount = (int)reset;
-          site.irLocation = loc;
-          funcPol.callsInOrder.push_back(site);
+        if (!funcPol) continue;
+        std::string loc = "unknown";
+        if (I.getDebugLoc()) {
+          auto DL = I.getDebugLoc();
+          loc = (Twine("line ") + Twine(DL.getLine())).str();
         }
+        PolicyJSON::LibCallSite site;
+        site.name = lst.coalesce ? coalescedLabel(lst) : CB->getCalledFunction()->getName().str();
+        site.uniqueID = siteIDs() ? (int)uniqueID : -1;
+        site.dummyID = (int)dummyID;
+        site.resetCount = (int)reset;
+        site.irLocation = loc;
+        funcPol->callsInOrder.push_back(site);
       }
+    }
+  }
 
-      // Export full graph structure into JSON for enforcement
-      for (const auto &n : G.nodes) {
-        funcPol.nodeLabels.push_back(n.pretty);
-        funcPol.nodeDummyIDs.push_back(n.dummyID);
-        funcPol.nodeUniqueIDs.push_back(n.uniqueID);
+  // Export full graph structure into JSON for enforcement
+  static void exportGraph(const Graph &G, PolicyJSON::FuncPolicy &funcPol) {
+    size_t N = G.numNodes();
+    funcPol.nodeLabels.reserve(N);
+    funcPol.nodeDummyIDs.reserve(N);
+    funcPol.nodeUniqueIDs.reserve(N);
+    funcPol.edges.reserve(G.numEdges());
+    for (size_t n = 0; n < N; ++n) {
+      funcPol.nodeLabels.push_back(G.label(n).str());
+      funcPol.nodeDummyIDs.push_back(G.dummyID(n));
+      funcPol.nodeUniqueIDs.push_back(G.uniqueID(n));
+    }
+    for (size_t src = 0; src < N; ++src) {
+      for (uint32_t e = G.edgeBegin(src); e < G.edgeEnd(src); ++e) {
+        PolicyJSON::Edge je;
+        je.src = src;
+        je.dst = G.target(e);
+        je.label = G.edgeLabel(e).str();
+        // If label is epsilon, matching is not applicable
+        if (G.edgeLabel(e) == "ϵ") {
+          je.matchDummy = -1;
+          je.matchUnique = -1;
+        } else {
+          // Find the matching node at src to determine its id for label matching.
+          // We use the node at 'src' as the emitter: label == callee of 'src'.
+          je.matchDummy = G.dummyID(src);
+          je.matchUnique = G.uniqueID(src);
+        }
+        funcPol.edges.push_back(je);
       }
-      for (size_t src = 0; src < G.adj.size(); ++src) {
-        for (auto eid : G.adj[src]) {
-          const auto &E = G.edges[eid];
-          PolicyJSON::Edge je;
-          je.src = src;
-          je.dst = E.target;
-          je.label = E.label;
-          // If label is epsilon, matching is not applicable
-          if (E.label == "ϵ") {
-            je.matchDummy = -1;
-            je.matchUnique = -1;
-          } else {
-            // Find the matching node at src to determine its id for label matching.
-            // We use the node at 'src' as the emitter: label == callee of 'src'.
-            je.matchDummy = G.nodes[src].dummyID;
-            je.matchUnique = G.nodes[src].uniqueID;
+    }
+    for (int id : G.indexedIDs())
+      funcPol.idStates.push_back({id, G.statesForID(id)});
+  }
+
+  // Runs on the DOT thread pool: statistics are atomic and errs() is
+  // unbuffered, so no extra locking is needed.
+  static void writeDOT(const std::string &path,
+                       function_ref<void(raw_ostream &)> Write) {
+    std::error_code EC;
+    raw_fd_ostream OS(path, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "Error opening DOT file: " << path << " : " << EC.message() << "\n";
+      return;
+    }
+    Write(OS);
+    NumBytesEmitted += OS.tell();
+  }
+
+  // ThinLTO backends run concurrently over one module each: give every module
+  // its own policy file and DOT directory, named after the module identifier.
+  static std::string moduleTag(const Module &M) {
+    MD5 Hasher;
+    Hasher.update(M.getModuleIdentifier());
+    MD5::MD5Result Res;
+    Hasher.final(Res);
+    return utohexstr(Res.low(), /*LowerCase=*/true);
+  }
+
+  static std::string policyPathFor(const Module &M, StringRef Path) {
+    if (LTOModeOpt != LTOMode::Thin) return Path.str();
+    StringRef Ext = sys::path::extension(Path);
+    return (Path.drop_back(Ext.size()) + "." + moduleTag(M) + Ext).str();
+  }
+
+  static std::string dotDirFor(const Module &M) {
+    if (LTOModeOpt != LTOMode::Thin) return DotOutDir;
+    return DotOutDir + "/" + moduleTag(M);
+  }
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    bool Pending = false;
+    for (Function &F : M)
+      if (!F.isDeclaration() && !F.hasFnAttribute(InstrumentedAttr)) Pending = true;
+    if (!Pending) return PreservedAnalyses::all();
+
+    std::string DotDir = dotDirFor(M);
+    std::string PolicyPath = policyPathFor(M, PolicyJSONOut);
+    EventSink Sink = makeEventSink(M);
+    ResultCache Cache(CacheDir);
+    SiteCounts Profile;
+    if (!SiteProfile.empty()) {
+      if (Checkpoints)
+        errs() << "libcall: -libcall-site-profile is ignored with -libcall-checkpoints\n";
+      else
+        Profile = loadSiteProfile(SiteProfile);
+    }
+
+    bool EmitDOT = EmitDOTOpt || !DotFilterOpt.empty();
+    Regex DotFilter(DotFilterOpt);
+    std::string RegexErr;
+    if (!DotFilterOpt.empty() && !DotFilter.isValid(RegexErr)) {
+      errs() << "Invalid -libcall-dot-filter: " << RegexErr << "\n";
+      EmitDOT = false;
+    }
+    std::unique_ptr<ThreadPool> DotPool;
+    if (EmitDOT) {
+      sys::fs::create_directories(DotDir);
+      DotPool = std::make_unique<ThreadPool>(hardware_concurrency(DotThreads));
+    }
+
+    // Serialized function entries in module order; hits and misses produce
+    // byte-identical entries, so the JSON does not depend on cache state.
+    std::vector<std::string> policyEntries;
+    // Only kept for -libcall-cxx-header / -libcall-report / -libcall-embed;
+    // hits are parsed back from the cache.
+    std::vector<PolicyJSON::FuncPolicy> keptFuncs;
+    bool EmitHeader = !CxxHeaderOut.empty();
+    bool EmitReport = !ReportOut.empty();
+    bool KeepFuncs = EmitHeader || EmitReport || EmbedPolicy;
+    auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    // Position among the module's definitions, counted whether or not the
+    // function is instrumented now. libcall-link renumbers it program-wide.
+    unsigned funcIndex = 0;
+    for (Function &F : M) {
+      if (F.isDeclaration()) continue;
+      unsigned FnIdx = funcIndex++;
+      uint32_t FnKey = functionKey(F);
+      if (F.hasFnAttribute(InstrumentedAttr)) continue;
+      F.addFnAttr(InstrumentedAttr);
+
+      std::vector<BBCallList> blocks = collectCalls(F);
+      auto blockOf = indexBlocks(blocks);
+      if (UseBFI)
+        markHotBlocks(blocks, FAM.getResult<BlockFrequencyAnalysis>(F));
+      if (auto *Counts = Profile.lookup(F, FnKey))
+        markProfiledBlocks(blocks, blockOf, *Counts);
+      if (Checkpoints)
+        selectCheckpoints(F, blocks, blockOf);
+      bool WantDOT = EmitDOT && (DotFilterOpt.empty() || DotFilter.match(F.getName()));
+      std::string dotPath = DotDir + "/" + std::string(F.getName()) + ".dot";
+      std::string key;
+      if (Cache.enabled()) {
+        key = hashFunction(F, FnIdx, FnKey, blocks);
+        auto Hit = Cache.lookup(key);
+        // Entries stored while DOT output was off carry no DOT text; if DOT
+        // is wanted now, recompute and refresh the entry.
+        PolicyJSON::FuncPolicy HitPol;
+        if (Hit && (!WantDOT || !Hit->dot.empty()) &&
+            (!KeepFuncs || PolicyJSON::parseFunction(Hit->policyJSON, HitPol))) {
+          ++NumCacheHits;
+          if (KeepFuncs) keptFuncs.push_back(std::move(HitPol));
+          instrumentFunction(F, FnKey, blocks, Sink, nullptr, {}, nullptr);
+          if (WantDOT) {
+            DotPool->async([dotPath, Text = std::move(Hit->dot)] {
+              writeDOT(dotPath, [&](raw_ostream &OS) { OS << Text; });
+            });
           }
-          funcPol.edges.push_back(je);
+          policyEntries.push_back(std::move(Hit->policyJSON));
+          continue;
         }
       }
 
-      // Emit DOT
+      if (Cache.enabled()) ++NumCacheMisses;
+      auto G = std::make_shared<Graph>();
+      G->functionName = std::string(F.getName());
+      G->initBuckets(HashMod);
+
+      std::map<Instruction*, size_t> callNodeIndex;
+      buildGraph(*G, blocks, blockOf, callNodeIndex);
+
+      PolicyJSON::FuncPolicy funcPol;
+      funcPol.functionName = G->functionName;
+      funcPol.funcIndex = FnIdx;
+      funcPol.funcKey = FnKey;
+      funcPol.mod = HashMod;
+      funcPol.idMode = idMode().str();
+
+      instrumentFunction(F, FnKey, blocks, Sink, G.get(), callNodeIndex, &funcPol);
+      exportGraph(*G, funcPol);
+      if (Checkpoints)
+        exportCheckpoints(blocks, blockOf, funcPol);
+
+      std::string policyJSON;
       {
-        std::error_code EC;
-        std::string path = (DotOutDir + "/" + std::string(F.getName()) + ".dot");
-        raw_fd_ostream OS(path, EC, sys::fs::OF_Text);
-        if (EC) {
-          errs() << "Error opening DOT file: " << path << " : " << EC.message() << "\n";
-        } else {
-          OS << G.toDOT();
-        }
+        TimeTraceScope Scope("LibCallEmitJSON", F.getName());
+        policyJSON = PolicyJSON::serializeFunction(funcPol);
+      }
+
+      // The graph is complete from here on; the DOT task only reads it.
+      if (WantDOT) {
+        std::string CacheJSON = Cache.enabled() ? policyJSON : std::string();
+        DotPool->async([G, dotPath, key, CacheJSON, &Cache] {
+          if (!Cache.enabled()) {
+            writeDOT(dotPath, [&](raw_ostream &OS) { G->writeDOT(OS); });
+            return;
+          }
+          CacheEntry Entry{CacheJSON, G->toDOT()};
+          writeDOT(dotPath, [&](raw_ostream &OS) { OS << Entry.dot; });
+          Cache.store(key, Entry);
+        });
+      } else if (Cache.enabled()) {
+        Cache.store(key, CacheEntry{policyJSON, std::string()});
       }
 
       // Record function policy
-      policyOut.functions.push_back(std::move(funcPol));
+      policyEntries.push_back(std::move(policyJSON));
+      if (KeepFuncs) keptFuncs.push_back(std::move(funcPol));
+    }
+
+    if (DotPool) {
+      TimeTraceScope Scope("LibCallEmitDOT", DotDir);
+      DotPool->wait();
     }
 
     // Emit policy JSON
     {
+      TimeTraceScope Scope("LibCallEmitJSON", PolicyPath);
       std::error_code EC;
-      raw_fd_ostream OS(PolicyJSONOut, EC, sys::fs::OF_Text);
+      raw_fd_ostream OS(PolicyPath, EC, sys::fs::OF_Text);
       if (EC) {
-        errs() << "Error opening policy JSON file: " << PolicyJSONOut << " : " << EC.message() << "\n";
+        errs() << "Error opening policy JSON file: " << PolicyPath << " : " << EC.message() << "\n";
       } else {
-        OS << policyOut.serialize();
+        std::string Doc = PolicyJSON::assemble(
+            policyEntries, LTOModeOpt == LTOMode::Thin ? M.getModuleIdentifier() : "");
+        OS << Doc;
+        NumBytesEmitted += Doc.size();
       }
     }
 
+    if (EmitHeader) {
+      std::string HeaderPath = policyPathFor(M, CxxHeaderOut);
+      TimeTraceScope Scope("LibCallEmitHeader", HeaderPath);
+      std::error_code EC;
+      raw_fd_ostream OS(HeaderPath, EC, sys::fs::OF_Text);
+      if (EC) {
+        errs() << "Error opening policy header: " << HeaderPath << " : " << EC.message() << "\n";
+      } else {
+        std::string Text = emitCxxHeader(
+            keptFuncs, LTOModeOpt == LTOMode::Thin ? M.getModuleIdentifier() : "");
+        OS << Text;
+        NumBytesEmitted += Text.size();
+      }
+    }
+
+    if (EmitReport) {
+      std::string ReportPath = policyPathFor(M, ReportOut);
+      TimeTraceScope Scope("LibCallEmitReport", ReportPath);
+      std::error_code EC;
+      raw_fd_ostream OS(ReportPath, EC, sys::fs::OF_Text);
+      if (EC) {
+        errs() << "Error opening policy report: " << ReportPath << " : " << EC.message() << "\n";
+      } else {
+        PolicyBudget Budget;
+        std::vector<PolicyCost> Costs;
+        for (const auto &F : keptFuncs) Costs.push_back(analyzePolicy(F, Budget));
+        writePolicyReport(OS, Costs, Budget,
+                          LTOModeOpt == LTOMode::Thin ? M.getModuleIdentifier() : "");
+      }
+    }
+
+    if (EmbedPolicy && !keptFuncs.empty()) embedPolicy(M, keptFuncs);
+
     return PreservedAnalyses::none();
   }
+
+  // One LCPB image per module. The linker concatenates the sections of all
+  // objects; 8-byte alignment keeps every image's tables aligned in place.
+  static void embedPolicy(Module &M, const std::vector<PolicyJSON::FuncPolicy> &Funcs) {
+    TimeTraceScope Scope("LibCallEmbedPolicy");
+    std::string Image = emitPolicyBinary(Funcs);
+    NumBytesEmitted += Image.size();
+    Constant *Init = ConstantDataArray::getString(M.getContext(), Image, /*AddNull=*/false);
+    auto *GV = new GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                                  GlobalValue::PrivateLinkage, Init, "__libcall_policy");
+    GV->setSection(Triple(M.getTargetTriple()).isOSBinFormatMachO() ? "__DATA,__libcall_policy"
+                                                                    : ".libcall_policy");
+    GV->setAlignment(Align(8));
+    appendToUsed(M, {GV});
+  }
 };
 
 } // end anonymous namespace
@@ -268,6 +1035,27 @@ extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginIn
             }
             return false;
           });
+
+      // Link-time instrumentation. Both callbacks are registered
+      // unconditionally and consult -libcall-lto when the pipeline is built,
+      // which happens after the linker has parsed its -mllvm options.
+#if LLVM_VERSION_MAJOR >= 15
+      PB.registerFullLinkTimeOptimizationLastEPCallback(
+          [](ModulePassManager &MPM, OptimizationLevel) {
+            if (LTOModeOpt == LTOMode::Full)
+              MPM.addPass(LibCallPass());
+          });
+#endif
+      // OptimizerLast serves two cases: compile-time late instrumentation
+      // (clang -fpass-plugin, opt -passes='default<O2>'), which sees the
+      // call set after the optimizer has deleted, merged or lowered libcalls
+      // to intrinsics, and ThinLTO backends, which build the regular module
+      // optimization pipeline once per backend thread.
+      PB.registerOptimizerLastEPCallback(
+          [](ModulePassManager &MPM, OptimizationLevel) {
+            if ((LateInstrument && LTOModeOpt == LTOMode::None) || LTOModeOpt == LTOMode::Thin)
+              MPM.addPass(LibCallPass());
+          });
     }
   };
 }
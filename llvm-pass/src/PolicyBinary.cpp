@@ -0,0 +1,148 @@
+#include "Policy/PolicyBinary.h"
+#include "Policy/PolicyFormat.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <cstring>
+
+using namespace policy;
+
+static_assert(llvm::support::endian::system_endianness() == llvm::support::little,
+              "LCPB images are written in host order");
+static_assert(sizeof(lcpb_header) == 72 && sizeof(lcpb_function) == 16 &&
+                  sizeof(lcpb_automaton) == 32 && sizeof(lcpb_edge) == 13 &&
+                  sizeof(lcpb_bucket) == 8,
+              "LCPB layout changed");
+
+namespace {
+
+template <typename T> void append(std::string &out, const T &v) {
+  out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+void align8(std::string &out) { out.resize((out.size() + 7) & ~size_t(7), '\0'); }
+
+void appendEdges(std::string &out, const PolicyJSON::FuncPolicy &f) {
+  for (const auto &E : f.edges) {
+    lcpb_edge e;
+    e.src = E.src;
+    e.dst = E.dst;
+    e.is_epsilon = PolicyJSON::isEpsilon(E);
+    e.match_id = PolicyJSON::matchID(f, E);
+    append(out, e);
+  }
+}
+
+// Row 0 is the start set, row i + 1 the checkpoints allowed after checkpoint i
+void appendRows(std::string &out, const PolicyJSON::FuncPolicy &f) {
+  const auto &CP = f.checkpoints;
+  size_t words = LCPB_ROW_WORDS(CP.reach.size());
+  auto row = [&](const llvm::BitVector &BV) {
+    std::vector<uint64_t> w(words);
+    for (int b = BV.find_first(); b >= 0; b = BV.find_next(b)) w[b / 64] |= uint64_t(1) << (b % 64);
+    out.append(reinterpret_cast<const char *>(w.data()), words * sizeof(uint64_t));
+  };
+  row(CP.start);
+  for (const auto &R : CP.reach) row(R);
+}
+
+// Name index at most half full; a name that occurs twice (internal functions
+// of different modules) resolves to its first entry
+std::vector<lcpb_bucket> buildIndex(const std::vector<PolicyJSON::FuncPolicy> &functions) {
+  std::vector<lcpb_bucket> index(llvm::PowerOf2Ceil(2 * functions.size()),
+                                 lcpb_bucket{0, LCPB_NO_FUNCTION});
+  size_t mask = index.size() - 1;
+  for (uint32_t i = 0; i < functions.size(); ++i) {
+    const std::string &name = functions[i].functionName;
+    uint32_t h = lcpb_name_hash(name.c_str());
+    size_t b = h & mask;
+    for (; index[b].function != LCPB_NO_FUNCTION; b = (b + 1) & mask)
+      if (index[b].hash == h && functions[index[b].function].functionName == name) break;
+    if (index[b].function == LCPB_NO_FUNCTION) index[b] = {h, i};
+  }
+  return index;
+}
+
+} // namespace
+
+std::string policy::encodeAutomaton(const PolicyJSON::FuncPolicy &f) {
+  std::string out;
+  append(out, uint32_t(f.nodeLabels.size()));
+  append(out, uint32_t(f.edges.size()));
+  append(out, uint32_t(f.checkpoints.reach.size()));
+  appendEdges(out, f);
+  if (f.checkpoints.region) appendRows(out, f);
+  return out;
+}
+
+std::string policy::emitPolicyBinary(const std::vector<PolicyJSON::FuncPolicy> &functions) {
+  // One automaton per function that is not an alias of an earlier one
+  llvm::DenseMap<uint32_t, uint32_t> automatonOfIndex;
+  std::vector<const PolicyJSON::FuncPolicy *> automata;
+  for (const auto &f : functions) {
+    if (f.aliasOf >= 0 && automatonOfIndex.count(f.aliasOf)) continue;
+    if (automatonOfIndex.try_emplace(f.funcIndex, automata.size()).second) automata.push_back(&f);
+  }
+
+  std::string strings;
+  std::vector<lcpb_function> table;
+  for (const auto &f : functions) {
+    lcpb_function fn = {};
+    fn.func_key = f.funcKey;
+    fn.name_offset = strings.size();
+    auto it = f.aliasOf >= 0 ? automatonOfIndex.find(f.aliasOf) : automatonOfIndex.end();
+    fn.automaton = it != automatonOfIndex.end() ? it->second : automatonOfIndex[f.funcIndex];
+    strings += f.functionName;
+    strings += '\0';
+    table.push_back(fn);
+  }
+
+  std::vector<lcpb_bucket> index = buildIndex(functions);
+
+  lcpb_header hdr = {};
+  std::memcpy(hdr.magic, LCPB_MAGIC, 4);
+  hdr.version = LCPB_VERSION;
+  hdr.num_functions = table.size();
+  hdr.num_automata = automata.size();
+  hdr.num_buckets = index.size();
+  const std::string &mode = functions.empty() ? std::string() : functions.front().idMode;
+  hdr.id_mode = mode == "global" ? LCPB_ID_GLOBAL : mode == "unique" ? LCPB_ID_UNIQUE : LCPB_ID_DUMMY;
+  hdr.functions_offset = sizeof(lcpb_header);
+  hdr.index_offset = hdr.functions_offset + table.size() * sizeof(lcpb_function);
+  hdr.automata_offset = hdr.index_offset + index.size() * sizeof(lcpb_bucket);
+  hdr.strings_offset = hdr.automata_offset + automata.size() * sizeof(lcpb_automaton);
+  hdr.strings_size = strings.size();
+
+  // Automaton payloads go after the (padded) string section
+  std::string payload;
+  std::vector<lcpb_automaton> descs;
+  uint64_t base = (hdr.strings_offset + strings.size() + 7) & ~uint64_t(7);
+  for (const auto *f : automata) {
+    lcpb_automaton a = {};
+    a.num_nodes = f->nodeLabels.size();
+    a.num_edges = f->edges.size();
+    a.num_checkpoints = f->checkpoints.reach.size();
+    a.edges_offset = base + payload.size();
+    appendEdges(payload, *f);
+    align8(payload);
+    if (f->checkpoints.region) {
+      a.rows_offset = base + payload.size();
+      appendRows(payload, *f);
+    }
+    descs.push_back(a);
+  }
+
+  std::string out;
+  out.reserve(base + payload.size());
+  hdr.total_size = base + payload.size();
+  append(out, hdr);
+  for (const auto &fn : table) append(out, fn);
+  for (const auto &b : index) append(out, b);
+  for (const auto &a : descs) append(out, a);
+  out += strings;
+  align8(out);
+  out += payload;
+  return out;
+}
@@ -0,0 +1,61 @@
+#include "Policy/PolicyCache.h"
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace policy;
+
+// Entry layout: "LCC1 <jsonLen> <dotLen>\n" followed by both payloads.
+static const char CacheMagic[] = "LCC1";
+
+ResultCache::ResultCache(std::string d) : dir(std::move(d)) {
+  if (!dir.empty())
+    sys::fs::create_directories(dir);
+}
+
+std::string ResultCache::pathFor(const std::string &key) const {
+  return dir + "/" + key + ".lcc";
+}
+
+std::optional<CacheEntry> ResultCache::lookup(const std::string &key) const {
+  if (!enabled()) return std::nullopt;
+  auto BufOrErr = MemoryBuffer::getFile(pathFor(key));
+  if (!BufOrErr) return std::nullopt;
+  StringRef Data = (*BufOrErr)->getBuffer();
+
+  StringRef Header;
+  std::tie(Header, Data) = Data.split('\n');
+  StringRef Magic, JsonLenStr, DotLenStr;
+  std::tie(Magic, Header) = Header.split(' ');
+  std::tie(JsonLenStr, DotLenStr) = Header.split(' ');
+  size_t JsonLen = 0, DotLen = 0;
+  if (Magic != CacheMagic || JsonLenStr.getAsInteger(10, JsonLen) ||
+      DotLenStr.getAsInteger(10, DotLen) || Data.size() != JsonLen + DotLen)
+    return std::nullopt; // truncated or foreign file: treat as a miss
+
+  CacheEntry E;
+  E.policyJSON = Data.substr(0, JsonLen).str();
+  E.dot = Data.substr(JsonLen).str();
+  return E;
+}
+
+void ResultCache::store(const std::string &key, const CacheEntry &entry) const {
+  if (!enabled()) return;
+  auto TmpOrErr = sys::fs::TempFile::create(dir + "/" + key + "-%%%%%%.tmp");
+  if (!TmpOrErr) {
+    consumeError(TmpOrErr.takeError());
+    return;
+  }
+  {
+    raw_fd_ostream OS(TmpOrErr->FD, /*shouldClose=*/false);
+    OS << CacheMagic << " " << entry.policyJSON.size() << " " << entry.dot.size() << "\n";
+    OS << entry.policyJSON << entry.dot;
+  }
+  if (Error E = TmpOrErr->keep(pathFor(key))) {
+    errs() << "Error writing cache entry " << key << " : " << toString(std::move(E)) << "\n";
+    consumeError(TmpOrErr->discard());
+  }
+}
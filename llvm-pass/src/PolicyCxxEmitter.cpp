@@ -0,0 +1,154 @@
+#include "Policy/PolicyCxxEmitter.h"
+
+#include <cctype>
+#include <map>
+#include <sstream>
+
+using namespace policy;
+
+namespace {
+
+// fn<funcIndex>_<name>: unique within the module and a valid identifier
+std::string structName(const PolicyJSON::FuncPolicy &f) {
+  std::string name = "fn" + std::to_string(f.funcIndex) + "_";
+  for (char c : f.functionName)
+    name += (std::isalnum(static_cast<unsigned char>(c)) || c == '_') ? c : '_';
+  return name;
+}
+
+void emitSets(std::ostream &os, const std::vector<bool> &states, const char *var) {
+  for (size_t s = 0; s < states.size(); ++s)
+    if (states[s]) os << " " << var << ".set(" << s << ");";
+}
+
+void emitFunction(std::ostream &os, const PolicyJSON::FuncPolicy &f) {
+  size_t N = f.nodeLabels.size();
+  auto cl = PolicyJSON::epsilonClosures(f);
+
+  os << "struct " << structName(f) << " {\n";
+  os << "  static constexpr const char *name = \"" << f.functionName << "\";\n";
+  os << "  static constexpr std::uint32_t funcIndex = " << f.funcIndex << ";\n";
+  os << "  static constexpr std::uint32_t funcKey = " << f.funcKey << "u;\n";
+  os << "  static constexpr std::size_t NumStates = " << N << ";\n";
+  os << "  static constexpr std::size_t NumTransitions = " << f.edges.size() << ";\n";
+  if (!f.edges.empty()) {
+    os << "  static constexpr Transition transitions[NumTransitions] = {";
+    for (size_t e = 0; e < f.edges.size(); ++e) {
+      const auto &E = f.edges[e];
+      os << (e % 6 ? " " : "\n      ") << "{" << E.src << ", " << E.dst << ", "
+         << PolicyJSON::matchID(f, E) << "}" << (e + 1 < f.edges.size() ? "," : "");
+    }
+    os << "};\n";
+  }
+  os << "  using Frontier = std::bitset<NumStates>;\n\n";
+
+  std::vector<bool> start = PolicyJSON::startStates(f, cl);
+  os << "  static Frontier start() {\n    Frontier s;";
+  emitSets(os, start, "s");
+  os << "\n    return s;\n  }\n\n";
+
+  // Transitions grouped by ID; each sets the ϵ-closure of its target
+  std::map<int, std::map<size_t, std::vector<bool>>> byID;
+  for (const auto &E : f.edges) {
+    int id = PolicyJSON::matchID(f, E);
+    if (id < 0 || E.src >= N || E.dst >= N) continue;
+    auto &targets = byID[id][E.src];
+    targets.resize(N);
+    for (size_t s : cl[E.dst]) targets[s] = true;
+  }
+  os << "  static Frontier advance([[maybe_unused]] const Frontier &s, std::int32_t id) {\n";
+  os << "    Frontier n;\n";
+  os << "    switch (id) {\n";
+  for (const auto &[id, sources] : byID) {
+    os << "    case " << id << ":\n";
+    for (const auto &[src, targets] : sources) {
+      os << "      if (s[" << src << "]) {";
+      emitSets(os, targets, "n");
+      os << " }\n";
+    }
+    os << "      break;\n";
+  }
+  os << "    default:\n      break;\n    }\n";
+  os << "    return n;\n  }\n};\n\n";
+}
+
+} // namespace
+
+std::string policy::emitCxxHeader(const std::vector<PolicyJSON::FuncPolicy> &functions,
+                                  const std::string &module) {
+  std::ostringstream os;
+  os << "// Generated by LibCallPass (-libcall-cxx-header). Do not edit.\n";
+  if (!module.empty()) os << "// module: " << module << "\n";
+  os << R"(#pragma once
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+namespace libcall_policy {
+
+struct Transition {
+  std::uint32_t src;
+  std::uint32_t dst;
+  std::int32_t id; // -1 for an epsilon edge
+};
+
+// One function's NFA frontier. step() returns false once the frontier is
+// empty, i.e. on a policy violation.
+template <typename Policy> class Checker {
+public:
+  Checker() : frontier(Policy::start()) {}
+  bool step(std::int32_t id) {
+    frontier = Policy::advance(frontier, id);
+    return frontier.any();
+  }
+  void reset() { frontier = Policy::start(); }
+  const std::bitset<Policy::NumStates> &states() const { return frontier; }
+
+private:
+  std::bitset<Policy::NumStates> frontier;
+};
+
+)";
+  for (const auto &f : functions) emitFunction(os, f);
+
+  bool global = !functions.empty() && functions.front().idMode == "global";
+  if (global) {
+    os << "// Global IDs: the function key in the high 32 bits picks the checker.\n";
+    os << "struct Program {\n";
+    for (const auto &f : functions)
+      os << "  Checker<" << structName(f) << "> f" << f.funcIndex << ";\n";
+    os << "\n  bool step(std::uint64_t id) {\n    switch (id >> 32) {\n";
+    for (const auto &f : functions)
+      os << "    case " << f.funcKey << "u:\n      return f" << f.funcIndex
+         << ".step(static_cast<std::int32_t>(id & 0xffffffffu));\n";
+    os << "    default:\n      return true; // no policy for this function\n    }\n  }\n};\n\n";
+  }
+  os << "} // namespace libcall_policy\n\n";
+
+  // In-process verifier in place of libdummy
+  os << "// Define LIBCALL_POLICY_DEFINE_DUMMY in one translation unit and link it\n"
+        "// instead of libdummy to check events in-process (single-threaded test and\n"
+        "// canary runs); a violation aborts.";
+  if (global) {
+    os << R"(
+#ifdef LIBCALL_POLICY_DEFINE_DUMMY
+extern "C" void dummy64(std::uint64_t id) {
+  static libcall_policy::Program program;
+  if (!program.step(id)) std::abort();
+}
+#endif
+)";
+  } else {
+    os << R"( Define it to the policy struct to enforce,
+// e.g. -DLIBCALL_POLICY_DEFINE_DUMMY=fn0_main.
+#ifdef LIBCALL_POLICY_DEFINE_DUMMY
+extern "C" void dummy(int id) {
+  static libcall_policy::Checker<libcall_policy::LIBCALL_POLICY_DEFINE_DUMMY> checker;
+  if (!checker.step(id)) std::abort();
+}
+#endif
+)";
+  }
+  return os.str();
+}
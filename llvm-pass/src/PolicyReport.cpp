@@ -0,0 +1,160 @@
+#include "Policy/PolicyReport.h"
+#include "Policy/PolicyFormat.h"
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
+#include <set>
+
+using namespace policy;
+
+namespace {
+
+// Kernel structures on x86-64 (kernel-module/libcallsandbox.c)
+constexpr uint64_t KernelAutomatonSize = 64; // struct automaton
+constexpr uint64_t KernelSlotSize = 16;      // struct func_slot, table at most half full
+
+// kmalloc size classes up to two pages, whole pages beyond (kvmalloc)
+uint64_t kmallocSize(uint64_t n) {
+  if (n == 0) return 0;
+  if (n <= 8) return 8;
+  if (n > 64 && n <= 96) return 96;
+  if (n > 128 && n <= 192) return 192;
+  if (n <= 8192) return llvm::PowerOf2Ceil(n);
+  return llvm::alignTo(n, 4096);
+}
+
+std::string bucketLabel(size_t lo) {
+  return lo < 2 ? std::to_string(lo) : std::to_string(lo) + "-" + std::to_string(2 * lo - 1);
+}
+
+} // namespace
+
+PolicyCost policy::analyzePolicy(const PolicyJSON::FuncPolicy &f, const PolicyBudget &budget) {
+  PolicyCost c;
+  c.functionName = f.functionName;
+  c.funcIndex = f.funcIndex;
+  c.funcKey = f.funcKey;
+  size_t N = c.states = f.nodeLabels.size();
+  c.edges = f.edges.size();
+  c.checkpoints = f.checkpoints.reach.size();
+
+  auto closures = PolicyJSON::epsilonClosures(f);
+  for (const auto &cl : closures) c.maxEpsilonClosure = std::max(c.maxEpsilonClosure, cl.size());
+
+  // Consuming transitions by source, targets already ϵ-closed
+  std::vector<std::vector<std::pair<int, size_t>>> out(N);
+  std::vector<size_t> degree(N);
+  std::set<int> ids;
+  for (const auto &E : f.edges) {
+    if (E.src >= N || E.dst >= N) continue;
+    ++degree[E.src];
+    int id = PolicyJSON::matchID(f, E);
+    if (id < 0) {
+      ++c.epsilonEdges;
+      continue;
+    }
+    ids.insert(id);
+    out[E.src].push_back({id, E.dst});
+  }
+  c.alphabet = ids.size();
+  for (size_t d : degree) ++c.outDegree[d < 2 ? d : llvm::PowerOf2Floor(d)];
+
+  // Subset construction; sorted state lists identify the subsets
+  std::vector<bool> start = PolicyJSON::startStates(f, closures);
+  std::vector<uint32_t> S0;
+  for (size_t s = 0; s < N; ++s)
+    if (start[s]) S0.push_back(s);
+  std::set<std::vector<uint32_t>> seen;
+  std::vector<std::vector<uint32_t>> work;
+  if (!S0.empty()) {
+    seen.insert(S0);
+    work.push_back(std::move(S0));
+  }
+  while (!work.empty()) {
+    std::vector<uint32_t> S = std::move(work.back());
+    work.pop_back();
+    c.maxFrontier = std::max(c.maxFrontier, S.size());
+    std::map<int, llvm::BitVector> next;
+    for (uint32_t s : S)
+      for (const auto &[id, dst] : out[s]) {
+        auto &BV = next[id];
+        if (BV.empty()) BV.resize(N);
+        for (size_t t : closures[dst]) BV.set(t);
+      }
+    c.dfaTransitions += next.size();
+    for (auto &[id, BV] : next) {
+      std::vector<uint32_t> T;
+      for (int t = BV.find_first(); t >= 0; t = BV.find_next(t)) T.push_back(t);
+      if (seen.count(T)) continue;
+      if (seen.size() >= budget.dfaLimit) {
+        c.dfaComplete = false;
+        continue;
+      }
+      seen.insert(T);
+      work.push_back(std::move(T));
+    }
+  }
+  c.dfaStates = seen.size();
+
+  uint64_t words = (N + 63) / 64 * 8;
+  c.nfaBytes = kmallocSize(KernelAutomatonSize) + kmallocSize(c.edges * sizeof(lcpb_edge)) +
+               2 * kmallocSize(words) + 2 * KernelSlotSize;
+  if (f.checkpoints.region && c.checkpoints)
+    c.checkpointBytes = kmallocSize(KernelAutomatonSize) +
+                        kmallocSize((c.checkpoints + 1) * LCPB_ROW_WORDS(c.checkpoints) * 8) +
+                        2 * KernelSlotSize;
+  c.dfaBytes = kmallocSize(uint64_t(c.dfaStates) * c.alphabet * sizeof(uint32_t));
+
+  if (!c.dfaComplete) c.flagged.push_back("dfaLimit");
+  if (budget.maxFrontier && c.maxFrontier > budget.maxFrontier) c.flagged.push_back("maxFrontier");
+  if (budget.maxDFAStates && c.dfaStates > budget.maxDFAStates) c.flagged.push_back("maxDFAStates");
+  uint64_t loaded = c.checkpointBytes ? c.checkpointBytes : c.nfaBytes;
+  if (budget.maxKernelBytes && loaded > budget.maxKernelBytes) c.flagged.push_back("maxKernelBytes");
+  return c;
+}
+
+void policy::writePolicyReport(llvm::raw_ostream &os, const std::vector<PolicyCost> &costs,
+                               const PolicyBudget &budget, llvm::StringRef module) {
+  uint64_t states = 0, edges = 0, nfa = 0, checkpoint = 0, dfa = 0;
+  size_t flagged = 0;
+  os << "{\n";
+  if (!module.empty()) os << "  \"module\": \"" << module << "\",\n";
+  os << "  \"budget\": {\"dfaLimit\":" << budget.dfaLimit << ",\"maxFrontier\":" << budget.maxFrontier
+     << ",\"maxDFAStates\":" << budget.maxDFAStates << ",\"maxKernelBytes\":" << budget.maxKernelBytes
+     << "},\n";
+  os << "  \"functions\": [\n";
+  for (size_t i = 0; i < costs.size(); ++i) {
+    const PolicyCost &c = costs[i];
+    os << "    {\"functionName\":\"" << c.functionName << "\",\"funcIndex\":" << c.funcIndex
+       << ",\"funcKey\":" << c.funcKey << ",\n";
+    os << "     \"states\":" << c.states << ",\"edges\":" << c.edges
+       << ",\"epsilonEdges\":" << c.epsilonEdges << ",\"alphabet\":" << c.alphabet
+       << ",\"checkpoints\":" << c.checkpoints << ",\n";
+    os << "     \"maxEpsilonClosure\":" << c.maxEpsilonClosure << ",\"maxFrontier\":" << c.maxFrontier
+       << ",\"dfaStates\":" << c.dfaStates << ",\"dfaTransitions\":" << c.dfaTransitions
+       << ",\"dfaComplete\":" << (c.dfaComplete ? "true" : "false") << ",\n";
+    os << "     \"outDegree\":{";
+    for (auto It = c.outDegree.begin(); It != c.outDegree.end(); ++It)
+      os << (It != c.outDegree.begin() ? "," : "") << "\"" << bucketLabel(It->first)
+         << "\":" << It->second;
+    os << "},\n";
+    os << "     \"kernelBytes\":{\"nfa\":" << c.nfaBytes << ",\"checkpoints\":" << c.checkpointBytes
+       << ",\"dfa\":" << c.dfaBytes << "},\"flagged\":[";
+    for (size_t k = 0; k < c.flagged.size(); ++k)
+      os << (k ? "," : "") << "\"" << c.flagged[k] << "\"";
+    os << "]}" << (i + 1 < costs.size() ? "," : "") << "\n";
+    states += c.states;
+    edges += c.edges;
+    nfa += c.nfaBytes;
+    checkpoint += c.checkpointBytes;
+    dfa += c.dfaBytes;
+    flagged += !c.flagged.empty();
+  }
+  os << "  ],\n";
+  os << "  \"totals\": {\"functions\":" << costs.size() << ",\"flagged\":" << flagged
+     << ",\"states\":" << states << ",\"edges\":" << edges << ",\"kernelBytes\":{\"nfa\":" << nfa
+     << ",\"checkpoints\":" << checkpoint << ",\"dfa\":" << dfa << "}}\n";
+  os << "}\n";
+}
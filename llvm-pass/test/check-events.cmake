@@ -0,0 +1,38 @@
+# ctest driver: run the plugin in a pipeline and check whether the output
+# carries events (calls to dummy/dummy64 or the libcall-instrumented mark).
+#
+#   -DOPT=<opt> -DPASSES=<pipeline>         opt over INPUT (an .ll file)
+#   -DCLANG=<clang> -DDIS=<llvm-dis>        clang over INPUT (a .c file),
+#     -DFLAGS=<a|b|...>                     compile flags, '|'-separated
+#   -DPLUGIN=<LibCallPass> -DINPUT=<file> -DWORK=<prefix> -DEXPECT=ON|OFF
+#   -DOPTIONS=<a|b|...>                     plugin options (opt only)
+string(REPLACE "|" ";" FLAGS "${FLAGS}")
+string(REPLACE "|" ";" OPTIONS "${OPTIONS}")
+get_filename_component(DIR ${WORK} DIRECTORY)
+file(MAKE_DIRECTORY ${DIR})
+
+if (OPT)
+  execute_process(
+    COMMAND ${OPT} -load ${PLUGIN} -load-pass-plugin ${PLUGIN} -passes=${PASSES} ${OPTIONS}
+            -libcall-policy-json=${WORK}.json -S ${INPUT} -o ${WORK}.ll
+    RESULT_VARIABLE rc ERROR_VARIABLE err)
+else()
+  execute_process(
+    COMMAND ${CLANG} ${FLAGS} -fpass-plugin=${PLUGIN} -c ${INPUT} -o ${WORK}.bc
+    WORKING_DIRECTORY ${DIR}
+    RESULT_VARIABLE rc ERROR_VARIABLE err)
+  if (rc EQUAL 0)
+    execute_process(COMMAND ${DIS} ${WORK}.bc -o ${WORK}.ll RESULT_VARIABLE rc ERROR_VARIABLE err)
+  endif()
+endif()
+if (NOT rc EQUAL 0)
+  message(FATAL_ERROR "command failed (${rc}): ${err}")
+endif()
+
+file(READ ${WORK}.ll IR)
+string(REGEX MATCH "@dummy|libcall-instrumented" FOUND "${IR}")
+if (EXPECT AND NOT FOUND)
+  message(FATAL_ERROR "expected events in ${WORK}.ll")
+elseif (NOT EXPECT AND FOUND)
+  message(FATAL_ERROR "unexpected events in ${WORK}.ll")
+endif()
@@ -0,0 +1,10 @@
+; Input for the pipeline tests: a libcall the optimizer keeps.
+declare i32 @puts(i8*)
+
+@msg = private constant [3 x i8] c"hi\00"
+
+define i32 @main() {
+entry:
+  %r = call i32 @puts(i8* getelementptr ([3 x i8], [3 x i8]* @msg, i64 0, i64 0))
+  ret i32 %r
+}
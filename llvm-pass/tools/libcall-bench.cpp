@@ -0,0 +1,163 @@
+// Throughput benchmark for LibCallPass.
+//
+// Runs `opt` with the plugin over each input module (typically produced by
+// libcall-irgen) and reports functions/sec, peak RSS and output sizes. Each
+// input is also run through `opt` without the pass, so the reported pass time
+// excludes IR parsing and bitcode writing. With -min-fps / -max-rss-mb the
+// tool exits non-zero when a run is over budget, so it can gate CI.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+struct RunResult {
+  bool ok = false;
+  double seconds = 0;
+  long maxRSSKB = 0;
+};
+
+RunResult runProcess(const std::vector<std::string> &args) {
+  RunResult r;
+  std::vector<char *> argv;
+  for (const auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); return r; }
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status = 0;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0) { perror("wait4"); return r; }
+  r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+  r.maxRSSKB = ru.ru_maxrss / 1024; // bytes on macOS
+#else
+  r.maxRSSKB = ru.ru_maxrss;
+#endif
+  r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return r;
+}
+
+long long fileSize(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? (long long)st.st_size : 0;
+}
+
+long long dirSize(const std::string &path) {
+  long long total = 0;
+  DIR *d = opendir(path.c_str());
+  if (!d) return 0;
+  while (struct dirent *e = readdir(d)) {
+    if (e->d_name[0] == '.') continue;
+    total += fileSize(path + "/" + e->d_name);
+  }
+  closedir(d);
+  return total;
+}
+
+unsigned countFunctions(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) return 0;
+  unsigned n = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), f))
+    if (!strncmp(line, "define ", 7)) ++n;
+  fclose(f);
+  return n;
+}
+
+std::string baseName(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  std::string b = slash == std::string::npos ? path : path.substr(slash + 1);
+  size_t dot = b.find_last_of('.');
+  return dot == std::string::npos ? b : b.substr(0, dot);
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s -opt <opt> -plugin <libLibCallPass.so> [-workdir <dir>]\n"
+          "          [-min-fps <functions/sec>] [-max-rss-mb <MB>] [-pass-arg <arg>]...\n"
+          "          <input.ll>...\n",
+          argv0);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string opt = "opt", plugin, workdir = "libcall_bench";
+  double minFPS = 0;
+  long maxRSSMB = 0;
+  std::vector<std::string> passArgs, inputs;
+
+  for (int i = 1; i < argc; ++i) {
+    auto next = [&]() -> const char * {
+      if (i + 1 >= argc) { usage(argv[0]); exit(1); }
+      return argv[++i];
+    };
+    if (!strcmp(argv[i], "-opt")) opt = next();
+    else if (!strcmp(argv[i], "-plugin")) plugin = next();
+    else if (!strcmp(argv[i], "-workdir")) workdir = next();
+    else if (!strcmp(argv[i], "-min-fps")) minFPS = atof(next());
+    else if (!strcmp(argv[i], "-max-rss-mb")) maxRSSMB = atol(next());
+    else if (!strcmp(argv[i], "-pass-arg")) passArgs.push_back(next());
+    else if (argv[i][0] == '-') { usage(argv[0]); return 1; }
+    else inputs.push_back(argv[i]);
+  }
+  if (plugin.empty() || inputs.empty()) { usage(argv[0]); return 1; }
+  mkdir(workdir.c_str(), 0755);
+
+  printf("%-24s %9s %9s %9s %12s %10s %10s %10s %10s\n", "input", "functions", "total(s)",
+         "pass(s)", "functions/s", "RSS(MB)", "json(KB)", "dot(KB)", "ir(KB)");
+  bool overBudget = false;
+  for (const auto &input : inputs) {
+    std::string dir = workdir + "/" + baseName(input);
+    mkdir(dir.c_str(), 0755);
+    unsigned functions = countFunctions(input);
+
+    RunResult base = runProcess({opt, input, "-o", dir + "/baseline.bc"});
+    std::vector<std::string> args = {opt, "-load", plugin, "-load-pass-plugin", plugin,
+                                     "-passes=libcall",
+                                     "-libcall-policy-json=" + dir + "/libcall_policy.json",
+                                     "-libcall-dot-dir=" + dir + "/libcall_dot"};
+    args.insert(args.end(), passArgs.begin(), passArgs.end());
+    args.insert(args.end(), {input, "-o", dir + "/instrumented.bc"});
+    RunResult run = runProcess(args);
+    if (!base.ok || !run.ok) {
+      fprintf(stderr, "%s: opt failed\n", input.c_str());
+      return 1;
+    }
+
+    double passSeconds = run.seconds > base.seconds ? run.seconds - base.seconds : 0;
+    double fps = passSeconds > 0 ? functions / passSeconds : 0;
+    double rssMB = run.maxRSSKB / 1024.0;
+    printf("%-24s %9u %9.3f %9.3f %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+           baseName(input).c_str(), functions, run.seconds, passSeconds, fps, rssMB,
+           fileSize(dir + "/libcall_policy.json") / 1024.0,
+           dirSize(dir + "/libcall_dot") / 1024.0,
+           fileSize(dir + "/instrumented.bc") / 1024.0);
+
+    if ((minFPS > 0 && passSeconds > 0 && fps < minFPS) ||
+        (maxRSSMB > 0 && rssMB > maxRSSMB)) {
+      fprintf(stderr, "%s: over budget (functions/s %.0f, min %.0f; RSS %.1f MB, max %ld)\n",
+              input.c_str(), fps, minFPS, rssMB, maxRSSMB);
+      overBudget = true;
+    }
+  }
+  return overBudget ? 2 : 0;
+}
@@ -0,0 +1,122 @@
+// Synthetic IR generator for LibCallPass throughput benchmarks.
+//
+// Writes a textual LLVM module with a configurable number of functions,
+// blocks per function, libcalls per block, switch fan-out and loop nesting.
+// All values are i64 (libcalls are declared with i64 parameters), so the
+// output parses with typed- and opaque-pointer LLVM versions alike. The IR is
+// only ever analyzed, never executed.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+namespace {
+
+struct GenOptions {
+  unsigned functions = 100;
+  unsigned blocks = 20;       // per function
+  double density = 2.0;       // average libcalls per block
+  unsigned switchFanout = 4;  // targets per switch (<= 1 disables switches)
+  unsigned loopDepth = 2;     // nested loops wrapped around each function body
+  unsigned seed = 1;
+  const char *out = nullptr;
+};
+
+const char *const LibCalls[] = {
+    "open", "read", "write", "close", "malloc", "free", "puts", "strlen",
+    "memcmp", "fopen", "fread", "fwrite", "fclose", "getenv", "time", "socket",
+};
+const unsigned NumLibCalls = sizeof(LibCalls) / sizeof(LibCalls[0]);
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-functions N] [-blocks N] [-density X] [-switch-fanout N]\n"
+          "          [-loop-depth N] [-seed N] [-o out.ll]\n",
+          argv0);
+}
+
+void emitFunction(FILE *f, unsigned index, const GenOptions &o, std::mt19937_64 &rng) {
+  unsigned B = o.blocks < 1 ? 1 : o.blocks;
+  // Loop d spans blocks [d, B-1-d]; its latch branches back to its header.
+  unsigned depth = o.loopDepth;
+  if (depth > B / 2) depth = B / 2;
+
+  std::poisson_distribution<unsigned> callsPerBlock(o.density > 0 ? o.density : 1.0);
+  std::uniform_int_distribution<unsigned> pickCall(0, NumLibCalls - 1);
+  std::uniform_int_distribution<unsigned> pickKind(0, 99);
+
+  // A separate entry block, because bb0 may be a loop header.
+  fprintf(f, "define i64 @fn%u(i64 %%a) {\nentry:\n  br label %%bb0\n", index);
+  unsigned tmp = 0;
+  for (unsigned b = 0; b < B; ++b) {
+    fprintf(f, "bb%u:\n", b);
+    unsigned n = o.density > 0 ? callsPerBlock(rng) : 0;
+    for (unsigned c = 0; c < n; ++c)
+      fprintf(f, "  %%t%u = call i64 @%s(i64 %%a)\n", tmp++, LibCalls[pickCall(rng)]);
+
+    if (b + 1 == B) {
+      fprintf(f, "  ret i64 0\n");
+      continue;
+    }
+    bool isLatch = false;
+    for (unsigned d = 0; d < depth; ++d)
+      if (b == B - 1 - d && b > d) isLatch = true;
+    if (isLatch) {
+      unsigned header = B - 1 - b;
+      fprintf(f, "  %%c%u = icmp ult i64 %%a, %u\n", b, b);
+      fprintf(f, "  br i1 %%c%u, label %%bb%u, label %%bb%u\n", b, header, b + 1);
+      continue;
+    }
+
+    // Forward targets only, so the loops above are the only cycles.
+    std::uniform_int_distribution<unsigned> pickTarget(b + 1, B - 1);
+    unsigned kind = pickKind(rng);
+    if (o.switchFanout > 1 && kind < 25) {
+      fprintf(f, "  switch i64 %%a, label %%bb%u [", b + 1);
+      for (unsigned k = 0; k < o.switchFanout; ++k)
+        fprintf(f, " i64 %u, label %%bb%u", k, pickTarget(rng));
+      fprintf(f, " ]\n");
+    } else if (kind < 60) {
+      fprintf(f, "  %%c%u = icmp eq i64 %%a, %u\n", b, b);
+      fprintf(f, "  br i1 %%c%u, label %%bb%u, label %%bb%u\n", b, pickTarget(rng), b + 1);
+    } else {
+      fprintf(f, "  br label %%bb%u\n", b + 1);
+    }
+  }
+  fprintf(f, "}\n\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  GenOptions o;
+  for (int i = 1; i < argc; ++i) {
+    auto next = [&]() -> const char * {
+      if (i + 1 >= argc) { usage(argv[0]); exit(1); }
+      return argv[++i];
+    };
+    if (!strcmp(argv[i], "-functions")) o.functions = (unsigned)atoi(next());
+    else if (!strcmp(argv[i], "-blocks")) o.blocks = (unsigned)atoi(next());
+    else if (!strcmp(argv[i], "-density")) o.density = atof(next());
+    else if (!strcmp(argv[i], "-switch-fanout")) o.switchFanout = (unsigned)atoi(next());
+    else if (!strcmp(argv[i], "-loop-depth")) o.loopDepth = (unsigned)atoi(next());
+    else if (!strcmp(argv[i], "-seed")) o.seed = (unsigned)atoi(next());
+    else if (!strcmp(argv[i], "-o")) o.out = next();
+    else { usage(argv[0]); return 1; }
+  }
+
+  FILE *f = o.out ? fopen(o.out, "w") : stdout;
+  if (!f) { perror(o.out); return 1; }
+
+  std::mt19937_64 rng(o.seed);
+  fprintf(f, "; generated by libcall-irgen: functions=%u blocks=%u density=%g "
+             "switch-fanout=%u loop-depth=%u seed=%u\n\n",
+          o.functions, o.blocks, o.density, o.switchFanout, o.loopDepth, o.seed);
+  for (unsigned k = 0; k < NumLibCalls; ++k)
+    fprintf(f, "declare i64 @%s(i64)\n", LibCalls[k]);
+  fprintf(f, "\n");
+  for (unsigned fn = 0; fn < o.functions; ++fn) emitFunction(f, fn, o, rng);
+
+  if (f != stdout) fclose(f);
+  return 0;
+}
@@ -0,0 +1,192 @@
+// Link-time merge of per-TU LibCallPass policies.
+//
+// Each input is a -libcall-policy-json file; `@file` reads more input names
+// from a response file. Inputs are parsed in parallel, a bounded window ahead
+// of the merge, which takes them in input order as they finish; so only the
+// window is held in memory and the output does not depend on scheduling:
+//
+//  - every function gets a dense, program-wide funcIndex;
+//  - definitions with the same funcKey and name (linkonce/inline functions
+//    emitted by several TUs) are merged when their automata agree, and are an
+//    error otherwise, since the kernel cannot tell which copy the linker kept;
+//  - a funcKey shared by two different names is a hash collision and always
+//    an error;
+//  - functions with identical automata are marked "aliasOf" the first one, and
+//    share one automaton in the binary output.
+//
+// Writes the program policy as JSON (same schema as the pass) and/or as an
+// LCPB image (Policy/PolicyFormat.h) that sandboxctl -b loads directly.
+#include "Policy/LibCallGraph.h"
+#include "Policy/PolicyBinary.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <unordered_map>
+
+using namespace llvm;
+using policy::PolicyJSON;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+                                    cl::desc("<policy.json | @listfile>..."));
+static cl::opt<std::string> OutputJSON("o", cl::desc("Program policy JSON output"),
+                                       cl::value_desc("file"), cl::init(""));
+static cl::opt<std::string> OutputBinary("b", cl::desc("Program policy LCPB output"),
+                                         cl::value_desc("file"), cl::init(""));
+static cl::opt<unsigned> Threads("j", cl::desc("Parser threads (0 = all cores)"), cl::init(0));
+static cl::opt<bool> KeepFirst("keep-first",
+                               cl::desc("Keep the first of conflicting definitions of a "
+                                        "function instead of failing"),
+                               cl::init(false));
+
+namespace {
+
+struct Parsed {
+  std::vector<PolicyJSON::FuncPolicy> functions;
+  std::vector<std::string> automata; // policy::encodeAutomaton, per function
+  std::string error;
+};
+
+Parsed parseInput(const std::string &path) {
+  Parsed P;
+  auto Buf = MemoryBuffer::getFile(path);
+  if (!Buf) {
+    P.error = Buf.getError().message();
+    return P;
+  }
+  Expected<json::Value> V = json::parse((*Buf)->getBuffer());
+  if (!V) {
+    P.error = toString(V.takeError());
+    return P;
+  }
+  const json::Object *O = V->getAsObject();
+  const json::Array *A = O ? O->getArray("functions") : nullptr;
+  if (!A) {
+    P.error = "no \"functions\" array";
+    return P;
+  }
+  for (const json::Value &E : *A) {
+    PolicyJSON::FuncPolicy f;
+    const json::Object *Fn = E.getAsObject();
+    if (!Fn || !PolicyJSON::parseFunction(*Fn, f)) {
+      P.error = "malformed function entry " + std::to_string(P.functions.size());
+      return P;
+    }
+    P.automata.push_back(policy::encodeAutomaton(f));
+    P.functions.push_back(std::move(f));
+  }
+  return P;
+}
+
+bool writeFile(StringRef path, function_ref<void(raw_ostream &)> write) {
+  std::error_code EC;
+  raw_fd_ostream OS(path, EC, sys::fs::OF_None);
+  if (EC) {
+    WithColor::error() << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  write(OS);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "LibCallPass policy linker\n");
+  if (OutputJSON.empty() && OutputBinary.empty()) {
+    WithColor::error() << "nothing to do: pass -o and/or -b\n";
+    return 1;
+  }
+
+  // Input i is parsed into slot i % Window, and input i + Window is started
+  // once the merge has taken input i out of it
+  ThreadPool Pool(hardware_concurrency(Threads));
+  const size_t Window = 2 * size_t(Pool.getThreadCount());
+  std::vector<Parsed> slots(Window);
+  std::vector<std::shared_future<void>> pending(Window);
+  auto parseAhead = [&](size_t i) {
+    if (i < Inputs.size())
+      pending[i % Window] = Pool.async([&, i] { slots[i % Window] = parseInput(Inputs[i]); });
+  };
+  for (size_t i = 0; i < Window; ++i)
+    parseAhead(i);
+
+  struct Seen {
+    size_t index;
+    std::string name;
+  };
+  std::unordered_map<uint32_t, Seen> byKey;
+  StringMap<uint32_t> byAutomaton; // encoding -> funcIndex of its first owner
+  std::vector<PolicyJSON::FuncPolicy> out;
+  std::vector<std::string> automata;
+  unsigned merged = 0, aliases = 0;
+  bool failed = false;
+  std::string idMode;
+
+  for (size_t i = 0; i < Inputs.size(); ++i) {
+    pending[i % Window].wait();
+    Parsed P = std::move(slots[i % Window]); // released once merged
+    parseAhead(i + Window);
+    if (!P.error.empty()) {
+      WithColor::error() << Inputs[i] << ": " << P.error << "\n";
+      failed = true;
+      continue;
+    }
+    for (size_t k = 0; k < P.functions.size(); ++k) {
+      PolicyJSON::FuncPolicy &f = P.functions[k];
+      if (idMode.empty()) idMode = f.idMode;
+      if (f.idMode != idMode) {
+        WithColor::error() << Inputs[i] << ": " << f.functionName << " uses -libcall-id-mode="
+                           << f.idMode << ", earlier inputs " << idMode << "\n";
+        failed = true;
+        continue;
+      }
+      auto [It, fresh] = byKey.try_emplace(f.funcKey, Seen{out.size(), f.functionName});
+      if (!fresh) {
+        const Seen &S = It->second;
+        if (S.name != f.functionName) {
+          WithColor::error() << Inputs[i] << ": funcKey " << f.funcKey << " of " << f.functionName
+                             << " collides with " << S.name << "\n";
+          failed = true;
+        } else if (automata[S.index] != P.automata[k]) {
+          (KeepFirst ? WithColor::warning() : WithColor::error())
+              << Inputs[i] << ": conflicting definitions of " << f.functionName
+              << (KeepFirst ? "; keeping the first\n" : "\n");
+          failed |= !KeepFirst;
+        }
+        ++merged;
+        continue;
+      }
+      f.funcIndex = out.size();
+      auto [A, first] = byAutomaton.try_emplace(P.automata[k], f.funcIndex);
+      f.aliasOf = first ? -1 : int64_t(A->second);
+      aliases += !first;
+      automata.push_back(std::move(P.automata[k]));
+      out.push_back(std::move(f));
+    }
+  }
+  if (failed) return 1;
+
+  if (!OutputJSON.empty()) {
+    std::vector<std::string> entries(out.size());
+    for (size_t i = 0; i < out.size(); ++i)
+      Pool.async([&, i] { entries[i] = PolicyJSON::serializeFunction(out[i]); });
+    Pool.wait();
+    if (!writeFile(OutputJSON, [&](raw_ostream &OS) { PolicyJSON::assemble(OS, entries); }))
+      return 1;
+  }
+  if (!OutputBinary.empty() &&
+      !writeFile(OutputBinary, [&](raw_ostream &OS) { OS << policy::emitPolicyBinary(out); }))
+    return 1;
+
+  errs() << "libcall-link: " << Inputs.size() << " inputs, " << out.size() << " functions ("
+         << merged << " duplicate definitions merged, " << aliases << " aliased automata)\n";
+  return 0;
+}
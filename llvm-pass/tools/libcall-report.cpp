@@ -0,0 +1,103 @@
+// Cost report for LibCallPass policies.
+//
+// Reads policy JSON (per module, or linked by libcall-link) and writes, per
+// function, the automaton's size, its ϵ-closure and frontier bounds, the size
+// of its determinization and the kernel memory each engine would take (see
+// Policy/PolicyReport.h). Functions over a -max-* budget are listed under
+// "flagged" and the tool exits with status 2, so a build can gate on it.
+#include "Policy/LibCallGraph.h"
+#include "Policy/PolicyReport.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using policy::PolicyJSON;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+                                    cl::desc("<policy.json | @listfile>..."));
+static cl::opt<std::string> Output("o", cl::desc("Report output"), cl::value_desc("file"),
+                                   cl::init("-"));
+static cl::opt<unsigned> Threads("j", cl::desc("Analysis threads (0 = all cores)"), cl::init(0));
+static cl::opt<unsigned> DFALimit("dfa-limit",
+                                  cl::desc("Stop determinizing a function after this many states"),
+                                  cl::init(10000));
+static cl::opt<unsigned> MaxFrontier("max-frontier",
+                                     cl::desc("Flag functions whose frontier can exceed this"),
+                                     cl::init(0));
+static cl::opt<unsigned> MaxDFAStates("max-dfa-states",
+                                      cl::desc("Flag functions whose DFA has more states"),
+                                      cl::init(0));
+static cl::opt<uint64_t> MaxKernelBytes("max-kernel-bytes",
+                                        cl::desc("Flag functions whose loaded engine takes more "
+                                                 "kernel memory"),
+                                        cl::init(0));
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "LibCallPass policy cost report\n");
+
+  std::vector<PolicyJSON::FuncPolicy> functions;
+  for (const std::string &Path : Inputs) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+      WithColor::error() << Path << ": " << Buf.getError().message() << "\n";
+      return 1;
+    }
+    Expected<json::Value> V = json::parse((*Buf)->getBuffer());
+    if (!V) {
+      WithColor::error() << Path << ": " << toString(V.takeError()) << "\n";
+      return 1;
+    }
+    const json::Object *O = V->getAsObject();
+    const json::Array *A = O ? O->getArray("functions") : nullptr;
+    if (!A) {
+      WithColor::error() << Path << ": no \"functions\" array\n";
+      return 1;
+    }
+    for (const json::Value &E : *A) {
+      PolicyJSON::FuncPolicy f;
+      const json::Object *Fn = E.getAsObject();
+      if (!Fn || !PolicyJSON::parseFunction(*Fn, f)) {
+        WithColor::error() << Path << ": malformed function entry\n";
+        return 1;
+      }
+      functions.push_back(std::move(f));
+    }
+  }
+
+  policy::PolicyBudget Budget;
+  Budget.dfaLimit = DFALimit;
+  Budget.maxFrontier = MaxFrontier;
+  Budget.maxDFAStates = MaxDFAStates;
+  Budget.maxKernelBytes = MaxKernelBytes;
+
+  std::vector<policy::PolicyCost> costs(functions.size());
+  ThreadPool Pool(hardware_concurrency(Threads));
+  for (size_t i = 0; i < functions.size(); ++i)
+    Pool.async([&, i] { costs[i] = policy::analyzePolicy(functions[i], Budget); });
+  Pool.wait();
+
+  std::error_code EC;
+  raw_fd_ostream OS(Output, EC, sys::fs::OF_Text);
+  if (EC) {
+    WithColor::error() << Output << ": " << EC.message() << "\n";
+    return 1;
+  }
+  policy::writePolicyReport(OS, costs, Budget);
+
+  unsigned flagged = 0;
+  for (const auto &c : costs) {
+    if (c.flagged.empty()) continue;
+    ++flagged;
+    WithColor::warning() << c.functionName << ": over budget (";
+    for (size_t k = 0; k < c.flagged.size(); ++k) errs() << (k ? ", " : "") << c.flagged[k];
+    errs() << ")\n";
+  }
+  return flagged ? 2 : 0;
+}
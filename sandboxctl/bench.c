@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: MIT
+// sandboxctl bench: end-to-end cost of enforcing a policy on this host.
+//
+// A workload walks the policy's automaton to build an event trace it
+// accepts, then a child replays the trace through each transport, timing
+// every event:
+//   noop        the workload loop with the event call stubbed out (baseline)
+//   unenforced  the dummy syscall for a pid without a policy (hook + lookup)
+//   syscall     the dummy syscall with the policy loaded (full enforcement)
+// Each round runs in a fresh child, which gets the policy replayed from one
+// recording before it starts and detached once it is done. An unenforced
+// child has any policy a recycled pid might carry detached first. With the
+// same seed and options, every run sends the same events.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "Policy/PolicyFormat.h"
+#include "sandboxctl.h"
+
+#ifndef __NR_dummy
+#define __NR_dummy 451 // as in libdummy; override with --nr
+#endif
+
+#define ROUND_EVENTS 4096
+
+enum transport { T_NOOP, T_UNENFORCED, T_SYSCALL, NUM_TRANSPORTS };
+static const char *const transport_names[NUM_TRANSPORTS] = {"noop", "unenforced", "syscall"};
+
+// xorshift64*, so traces depend only on the seed
+static uint64_t rng_state;
+static uint32_t rng_below(uint32_t n)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * 2685821657736338717ull) >> 32) % n;
+}
+
+// ---- Trace generation ----
+
+static void closure(const struct lcpb_edge *e, uint32_t ne, uint8_t *f)
+{
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (uint32_t i = 0; i < ne; ++i)
+      if (e[i].is_epsilon && f[e[i].src] && !f[e[i].dst]) f[e[i].dst] = changed = 1;
+  }
+}
+
+// Random accepted walk over an NFA under the kernel's semantics
+static size_t walk_nfa(const struct lcpb_edge *e, uint32_t nodes, uint32_t ne, uint64_t key_high,
+                       uint64_t *out, size_t max)
+{
+  uint8_t *f = calloc(nodes, 1), *g = malloc(nodes);
+  uint32_t *enabled = malloc(ne * sizeof(uint32_t) + 1);
+  size_t n = 0;
+  if (!f || !g || !enabled) goto done;
+  memset(f, 1, nodes);
+  for (uint32_t i = 0; i < ne; ++i)
+    if (!e[i].is_epsilon) f[e[i].dst] = 0;
+  closure(e, ne, f);
+  while (n < max) {
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < ne; ++i)
+      if (!e[i].is_epsilon && f[e[i].src]) enabled[k++] = i;
+    if (!k) break; // dead end: the trace is complete
+    int32_t id = e[enabled[rng_below(k)]].match_id;
+    memset(g, 0, nodes);
+    for (uint32_t i = 0; i < ne; ++i)
+      if (!e[i].is_epsilon && e[i].match_id == id && f[e[i].src]) g[e[i].dst] = 1;
+    closure(e, ne, g);
+    memcpy(f, g, nodes);
+    out[n++] = key_high | (uint32_t)id;
+  }
+done:
+  free(f);
+  free(g);
+  free(enabled);
+  return n;
+}
+
+static size_t walk_checkpoints(const uint64_t *rows, uint32_t count, uint64_t key_high, uint64_t *out,
+                               size_t max)
+{
+  size_t words = LCPB_ROW_WORDS(count), n = 0;
+  uint32_t last = 0, *allowed = malloc(count * sizeof(uint32_t) + 1);
+  while (allowed && n < max) {
+    const uint64_t *row = rows + (size_t)last * words;
+    uint32_t k = 0;
+    for (uint32_t id = 1; id <= count; ++id)
+      if (row[(id - 1) / 64] >> ((id - 1) % 64) & 1) allowed[k++] = id;
+    if (!k) break;
+    last = allowed[rng_below(k)];
+    out[n++] = key_high | last;
+  }
+  free(allowed);
+  return n;
+}
+
+// Size of the automaton a recorded call loads, to pick the richest one
+static uint64_t call_weight(const struct recorded_ioctl *c)
+{
+  if (c->cmd == IOCTL_LOAD_CHECKPOINTS) return ((const struct checkpoint_blob*)c->blob)->num_checkpoints;
+  if (c->cmd == IOCTL_LOAD_FUNC_POLICY) return ((const struct policy_blob_v2*)c->blob)->num_edges;
+  return ((const struct policy_blob*)c->blob)->num_edges;
+}
+
+// One round's trace through the largest automaton the policy loads
+static size_t make_trace(const struct policy_recording *rec, uint64_t *out, size_t max, const char **engine)
+{
+  const struct recorded_ioctl *c = &rec->calls[0];
+  for (size_t i = 1; i < rec->count; ++i)
+    if (call_weight(&rec->calls[i]) > call_weight(c)) c = &rec->calls[i];
+
+  if (c->cmd == IOCTL_LOAD_CHECKPOINTS) {
+    const struct checkpoint_blob *b = c->blob;
+    *engine = "ckpt";
+    return walk_checkpoints((const uint64_t*)(b + 1), b->num_checkpoints,
+                            (b->flags & CHECKPOINT_GLOBAL) ? (uint64_t)b->func_key << 32 : 0, out, max);
+  }
+  *engine = "nfa";
+  if (c->cmd == IOCTL_LOAD_FUNC_POLICY) {
+    const struct policy_blob_v2 *b = c->blob;
+    return walk_nfa((const struct lcpb_edge*)(b + 1), b->num_nodes, b->num_edges, (uint64_t)b->func_key << 32,
+                    out, max);
+  }
+  const struct policy_blob *b = c->blob;
+  return walk_nfa((const struct lcpb_edge*)(b + 1), b->num_nodes, b->num_edges, 0, out, max);
+}
+
+// ---- Timed rounds ----
+
+static void noop_event(uint64_t id) { (void)id; }
+static void (*volatile noop_sink)(uint64_t) = noop_event;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Median cost of the two clock reads around each event
+static uint64_t timer_overhead(void)
+{
+  uint64_t s[1001];
+  for (int i = 0; i < 1001; ++i) {
+    uint64_t t0 = now_ns();
+    s[i] = now_ns() - t0;
+  }
+  for (int i = 1; i < 1001; ++i)
+    for (int j = i; j > 0 && s[j - 1] > s[j]; --j) { uint64_t t = s[j]; s[j] = s[j - 1]; s[j - 1] = t; }
+  return s[500];
+}
+
+struct bench_config {
+  long nr;
+  int cpu;             // pin the workload here, -1 for no pinning
+  uint64_t timer_ns;
+};
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+  for (const char *p = buf; n;) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+  for (char *p = buf; n;) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 0;
+}
+
+// Child side: wait for the go byte, send the trace, report one u32 ns per
+// event
+static void run_child(int go, int out, const uint64_t *trace, size_t n, enum transport t,
+                      const struct bench_config *cfg)
+{
+  uint32_t *ns = malloc(n * sizeof(uint32_t) + 1);
+  char c = 0;
+  if (cfg->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cfg->cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+  while (read(go, &c, 1) < 0 && errno == EINTR) ;
+  if (c != 'g' || !ns) _exit(127);
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t t0 = now_ns();
+    if (t == T_NOOP) noop_sink(trace[i]);
+    else syscall(cfg->nr, trace[i]);
+    uint64_t d = now_ns() - t0;
+    d = d > cfg->timer_ns ? d - cfg->timer_ns : 0;
+    ns[i] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+  }
+  _exit(write_all(out, ns, n * sizeof(uint32_t)) ? 1 : 0);
+}
+
+// Drop pid's policy. Not having one is fine, and so is a module without
+// IOCTL_DETACH (it frees nothing before unload) or no device at all (fd < 0:
+// only noop and unenforced run, and nothing can hold a policy).
+static int detach_pid(int fd, pid_t pid)
+{
+  uint32_t id = (uint32_t)pid;
+  if (fd < 0) return 0;
+  if (ioctl(fd, IOCTL_DETACH, &id) == 0 || errno == ENOENT || errno == ENOTTY) return 0;
+  perror("ioctl detach");
+  return -1;
+}
+
+// One round in a fresh child. Appends its samples to `ns`; returns 0, or -1
+// with a message.
+static int run_round(int fd, const struct policy_recording *rec, const uint64_t *trace, size_t n,
+                     enum transport t, const struct bench_config *cfg, uint32_t *ns)
+{
+  int go[2], res[2];
+  if (pipe2(go, O_CLOEXEC) != 0 || pipe2(res, O_CLOEXEC) != 0) { perror("pipe"); return -1; }
+  fflush(NULL);
+  pid_t child = fork();
+  if (child < 0) { perror("fork"); return -1; }
+  if (child == 0) {
+    close(go[1]);
+    close(res[0]);
+    run_child(go[0], res[1], trace, n, t, cfg);
+  }
+  close(go[0]);
+  close(res[1]);
+
+  int rc = 0;
+  if (t == T_SYSCALL && replay_policy(fd, child, rec) != 0) {
+    perror("ioctl load");
+    rc = -1;
+  }
+  if (t == T_UNENFORCED && detach_pid(fd, child) != 0) rc = -1;
+  if (rc == 0 && write(go[1], "g", 1) != 1) rc = -1;
+  close(go[1]);
+  if (rc == 0 && read_all(res[0], ns, n * sizeof(uint32_t)) != 0) rc = -1;
+  close(res[0]);
+  // Before the wait, while the pid cannot be reused
+  if (t == T_SYSCALL && detach_pid(fd, child) != 0) rc = -1;
+
+  int status;
+  while (waitpid(child, &status, 0) < 0 && errno == EINTR) ;
+  if (rc == 0 && WIFSIGNALED(status)) {
+    fprintf(stderr, "%s: workload killed by signal %d%s\n", transport_names[t], WTERMSIG(status),
+            WTERMSIG(status) == SIGKILL ? " (trace rejected by the policy?)" : "");
+    rc = -1;
+  }
+  return rc;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t pct(const uint32_t *sorted, size_t n, double p)
+{
+  size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+  return sorted[i < n ? i : n - 1];
+}
+
+static void bench_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s (-j <policy.json>|-b <policy.lcpb>|-e <executable>) [-f <index>|<name>|all]\n"
+                  "       [--unique|--global] [--checkpoints] [--compiled] [-t noop,unenforced,syscall]\n"
+                  "       [-n <events>] [--seed N] [--cpu N] [--nr <syscall>]\n", argv0);
+  fprintf(stderr, "Replays an accepted event trace of the policy through each transport and reports\n"
+                  "events/s and per-event latency percentiles (timer overhead subtracted).\n");
+}
+
+int bench_main(int argc, char **argv)
+{
+  struct policy_source src = { .id_mode = ID_MODE_DUMMY };
+  struct bench_config cfg = { .nr = __NR_dummy, .cpu = -1 };
+  size_t events = 200000;
+  unsigned transports = (1u << NUM_TRANSPORTS) - 1;
+  rng_state = 0x9e3779b97f4a7c15ull;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (parse_source_option(argc, argv, &i, &src)) continue;
+    if (!value) { bench_usage(argv[0]); return 1; }
+    if (!strcmp(argv[i], "-n")) events = strtoull(value, NULL, 10);
+    else if (!strcmp(argv[i], "--seed")) rng_state = strtoull(value, NULL, 0) | 1;
+    else if (!strcmp(argv[i], "--cpu")) cfg.cpu = atoi(value);
+    else if (!strcmp(argv[i], "--nr")) cfg.nr = strtol(value, NULL, 0);
+    else if (!strcmp(argv[i], "-t")) {
+      transports = 0;
+      char *copy = strdup(value), *save = NULL;
+      for (char *tok = copy ? strtok_r(copy, ",", &save) : NULL; tok; tok = strtok_r(NULL, ",", &save)) {
+        int k = 0;
+        while (k < NUM_TRANSPORTS && strcmp(tok, transport_names[k])) ++k;
+        if (k == NUM_TRANSPORTS) {
+          fprintf(stderr, "unknown transport '%s'\n", tok);
+          free(copy);
+          return 1;
+        }
+        transports |= 1u << k;
+      }
+      free(copy);
+    } else { bench_usage(argv[0]); return 1; }
+    ++i;
+  }
+  if (!!src.json_path + !!src.binary_path + !!src.exe_path != 1 || !events || !transports) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  struct policy_recording rec;
+  if (record_policy(&src, &rec) != 0) return 1;
+  if (!rec.count) { fprintf(stderr, "policy loads nothing\n"); return 1; }
+  int fd = open(DEVICE_PATH, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && (transports & (1u << T_SYSCALL))) {
+    fprintf(stderr, "syscall: skipped, cannot open %s: %s\n", DEVICE_PATH, strerror(errno));
+    transports &= ~(1u << T_SYSCALL);
+  }
+
+  uint64_t *trace = malloc(ROUND_EVENTS * sizeof(uint64_t));
+  uint32_t *ns = malloc(events * sizeof(uint32_t) + ROUND_EVENTS * sizeof(uint32_t));
+  const char *engine = "nfa";
+  int rc = 0;
+  if (!trace || !ns) { perror("malloc"); rc = 1; goto out; }
+  cfg.timer_ns = timer_overhead();
+
+  struct utsname u;
+  uname(&u);
+  printf("sandboxctl bench: %s %s, %zu automata, %zu events per transport, timer overhead %lluns\n", u.sysname,
+         u.release, rec.count, events, (unsigned long long)cfg.timer_ns);
+  printf("%-11s %-5s %9s %12s %8s %8s %8s %8s %8s %9s\n", "TRANSPORT", "ENGINE", "EVENTS", "EVENTS/S", "P50", "P90",
+         "P99", "P99.9", "MAX", "OVERHEAD");
+
+  double noop_mean = -1;
+  for (int t = 0; t < NUM_TRANSPORTS; ++t) {
+    if (!(transports & (1u << t))) continue;
+    uint64_t seed = rng_state; // every transport replays the same traces
+    size_t got = 0;
+    while (got < events) {
+      size_t n = make_trace(&rec, trace, events - got < ROUND_EVENTS ? events - got : ROUND_EVENTS, &engine);
+      if (!n) {
+        fprintf(stderr, "the policy accepts no events (no consuming edge from its start states)\n");
+        rc = 1;
+        goto out;
+      }
+      if (run_round(fd, &rec, trace, n, (enum transport)t, &cfg, ns + got) != 0) { rc = 1; break; }
+      got += n;
+    }
+    rng_state = seed;
+    if (got < events) continue;
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < got; ++i) sum += ns[i];
+    qsort(ns, got, sizeof(uint32_t), cmp_u32);
+    double mean = (double)sum / (double)got;
+    char overhead[24] = "-";
+    if (t == T_NOOP) noop_mean = mean;
+    else if (noop_mean >= 0) snprintf(overhead, sizeof(overhead), "%+.0fns", mean - noop_mean);
+    printf("%-11s %-5s %9zu %12.0f %6uns %6uns %6uns %6uns %6uns %9s\n", transport_names[t],
+           t == T_SYSCALL ? engine : "-", got, sum ? (double)got * 1e9 / (double)sum : 0, pct(ns, got, 0.5),
+           pct(ns, got, 0.9), pct(ns, got, 0.99), pct(ns, got, 0.999), ns[got - 1], overhead);
+    fflush(stdout);
+  }
+
+out:
+  if (fd >= 0) close(fd);
+  free(trace);
+  free(ns);
+  free_recording(&rec);
+  return rc;
+}
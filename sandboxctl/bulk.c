@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: MIT
+// Bulk attach: one policy, many processes.
+//
+// Targets are explicit pids plus selectors (process group, session, the
+// threads of a process, every process running an executable) resolved in a
+// single pass over /proc. The policy is parsed once into a recording of its
+// load ioctls, which IOCTL_ATTACH_MANY applies to every pid in one call: the
+// kernel copies and checks each blob once and duplicates the automaton per
+// pid. Modules without that ioctl get the recording replayed per pid.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "sandboxctl.h"
+
+static int add_pid(struct target_set *t, pid_t pid)
+{
+  if (t->count == t->cap) {
+    size_t cap = t->cap ? 2 * t->cap : 64;
+    pid_t *grown = realloc(t->pids, cap * sizeof(pid_t));
+    if (!grown) { perror("realloc"); return -1; }
+    t->pids = grown;
+    t->cap = cap;
+  }
+  t->pids[t->count++] = pid;
+  return 0;
+}
+
+static int parse_pid(const char *s, pid_t *out)
+{
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (end == s || *end || v <= 0) return -1;
+  *out = (pid_t)v;
+  return 0;
+}
+
+int parse_target_option(int argc, char **argv, int *i, struct target_set *t)
+{
+  const char *arg = argv[*i];
+  if (!strcmp(arg, "--threads")) {
+    t->threads = 1;
+    return 1;
+  }
+  if (*i + 1 >= argc) return 0;
+  const char *value = argv[*i + 1];
+  if (!strcmp(arg, "-p")) {
+    // -p 12,13,14 or repeated -p
+    char *copy = strdup(value), *save = NULL;
+    if (!copy) { perror("strdup"); return -1; }
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+      pid_t pid;
+      if (parse_pid(tok, &pid) != 0) {
+        fprintf(stderr, "-p: bad pid '%s'\n", tok);
+        free(copy);
+        return -1;
+      }
+      if (add_pid(t, pid) != 0) { free(copy); return -1; }
+    }
+    free(copy);
+  } else if (!strcmp(arg, "--pgid") || !strcmp(arg, "--sid") || !strcmp(arg, "--tgid")) {
+    pid_t *slot = arg[2] == 'p' ? &t->pgid : arg[2] == 's' ? &t->sid : &t->tgid;
+    if (parse_pid(value, slot) != 0) {
+      fprintf(stderr, "%s: bad id '%s'\n", arg, value);
+      return -1;
+    }
+  } else if (!strcmp(arg, "--exe")) {
+    t->exe = value;
+  } else {
+    return 0;
+  }
+  ++*i;
+  return 1;
+}
+
+int target_is_single(const struct target_set *t)
+{
+  return t->count == 1 && !t->pgid && !t->sid && !t->tgid && !t->exe && !t->threads;
+}
+
+// Threads of `tgid` from /proc/<tgid>/task
+static int add_threads(struct target_set *t, pid_t tgid)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", (int)tgid);
+  DIR *d = opendir(path);
+  if (!d) return 0; // exited
+  struct dirent *de;
+  int rc = 0;
+  while (!rc && (de = readdir(d))) {
+    pid_t tid;
+    if (parse_pid(de->d_name, &tid) == 0) rc = add_pid(t, tid);
+  }
+  closedir(d);
+  return rc;
+}
+
+// Process group and session of `pid` from /proc/<pid>/stat
+static int read_ids(pid_t pid, pid_t *pgid, pid_t *sid)
+{
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = 0;
+  // The command name may contain anything, so parse after its last ')'
+  const char *p = strrchr(buf, ')');
+  int ppid, pg, s;
+  char state;
+  if (!p || sscanf(p + 1, " %c %d %d %d", &state, &ppid, &pg, &s) != 4) return -1;
+  *pgid = pg;
+  *sid = s;
+  return 0;
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+  pid_t x = *(const pid_t*)a, y = *(const pid_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Expand the selectors into t->pids (sorted, without duplicates or this
+// process)
+static int resolve_targets(struct target_set *t)
+{
+  struct stat exe_st;
+  if (t->exe && stat(t->exe, &exe_st) != 0) {
+    fprintf(stderr, "%s: %s\n", t->exe, strerror(errno));
+    return -1;
+  }
+  if (t->tgid && add_threads(t, t->tgid) != 0) return -1;
+
+  if (t->pgid || t->sid || t->exe) {
+    DIR *d = opendir("/proc");
+    if (!d) { perror("/proc"); return -1; }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+      pid_t pid, pgid, sid;
+      if (parse_pid(de->d_name, &pid) != 0) continue;
+      int match = 0;
+      if ((t->pgid || t->sid) && read_ids(pid, &pgid, &sid) == 0)
+        match = (t->pgid && pgid == t->pgid) || (t->sid && sid == t->sid);
+      if (!match && t->exe) {
+        char path[64];
+        struct stat st;
+        snprintf(path, sizeof(path), "/proc/%d/exe", (int)pid);
+        match = stat(path, &st) == 0 && st.st_dev == exe_st.st_dev && st.st_ino == exe_st.st_ino;
+      }
+      if (match && add_pid(t, pid) != 0) { closedir(d); return -1; }
+    }
+    closedir(d);
+  }
+
+  // Policies are keyed by thread ID, so a process's other threads need
+  // their own copy
+  if (t->threads)
+    for (size_t i = 0, n = t->count; i < n; ++i)
+      if (add_threads(t, t->pids[i]) != 0) return -1;
+
+  qsort(t->pids, t->count, sizeof(pid_t), cmp_pid);
+  size_t out = 0;
+  pid_t self = getpid();
+  for (size_t i = 0; i < t->count; ++i)
+    if (t->pids[i] != self && (!out || t->pids[out - 1] != t->pids[i])) t->pids[out++] = t->pids[i];
+  t->count = out;
+  return 0;
+}
+
+static double elapsed_ms(const struct timespec *t0)
+{
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (double)(t1.tv_sec - t0->tv_sec) * 1e3 + (double)(t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+// Apply `rec` to pids[0..n) in one ioctl. Returns the number of leading pids
+// handled, of which *skipped had exited, or -1 (errno ENOTTY if the module
+// predates IOCTL_ATTACH_MANY).
+static long attach_vectored(int fd, const pid_t *pids, size_t n, const struct policy_recording *rec,
+                            size_t *skipped)
+{
+  uint32_t *ids = malloc(n * sizeof(uint32_t) + 1);
+  struct attach_call *calls = malloc(rec->count * sizeof(*calls) + 1);
+  struct attach_many req = { .num_pids = (uint32_t)n, .num_calls = (uint32_t)rec->count,
+                             .pids = (uintptr_t)ids, .calls = (uintptr_t)calls };
+  long rc = -1;
+  if (!ids || !calls) { perror("malloc"); goto out; }
+  for (size_t i = 0; i < n; ++i) ids[i] = (uint32_t)pids[i];
+  for (size_t c = 0; c < rec->count; ++c)
+    calls[c] = (struct attach_call){ .cmd = (uint32_t)rec->calls[c].cmd, .blob = (uintptr_t)rec->calls[c].blob };
+  if (ioctl(fd, IOCTL_ATTACH_MANY, &req) == 0) {
+    rc = (long)req.attached + req.skipped;
+  } else if (errno != ENOTTY) {
+    rc = (long)req.attached + req.skipped;
+    fprintf(stderr, "ioctl attach many: pid %d: %s\n", (size_t)rc < n ? (int)pids[rc] : -1, strerror(errno));
+  }
+  if (rc > 0) *skipped += req.skipped;
+out:
+  free(ids);
+  free(calls);
+  return rc;
+}
+
+int attach_targets(struct target_set *t, const struct policy_source *src)
+{
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (resolve_targets(t) != 0) return 1;
+  if (!t->count) {
+    fprintf(stderr, "no processes match\n");
+    return 1;
+  }
+
+  struct policy_recording rec;
+  if (record_policy(src, &rec) != 0) return 1;
+  int fd = open(DEVICE_PATH, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open " DEVICE_PATH);
+    free_recording(&rec);
+    return 1;
+  }
+
+  size_t done = 0, skipped = 0;
+  int failed = 0, vectored = 1;
+  while (done < t->count && !failed) {
+    size_t chunk = t->count - done < MAX_ATTACH_PIDS ? t->count - done : MAX_ATTACH_PIDS;
+    long n = vectored ? attach_vectored(fd, t->pids + done, chunk, &rec, &skipped) : -1;
+    if (n < 0 && vectored && errno == ENOTTY) {
+      vectored = 0;
+      continue;
+    }
+    if (!vectored) {
+      // Older module: one ioctl per pid and call
+      for (n = 0; (size_t)n < chunk; ++n) {
+        if (replay_policy(fd, t->pids[done + n], &rec) == 0) continue;
+        if (errno != ESRCH) break;
+        skipped++; // exited since /proc was read
+      }
+      if ((size_t)n < chunk)
+        fprintf(stderr, "pid %d: %s\n", (int)t->pids[done + n], strerror(errno));
+    }
+    if (n < 0) n = 0;
+    done += (size_t)n;
+    failed = (size_t)n < chunk;
+  }
+  close(fd);
+
+  printf("Attached %zu of %zu processes (%zu exited first), %zu ioctl%s each%s, in %.2f ms\n", done - skipped,
+         t->count, skipped, rec.count, rec.count == 1 ? "" : "s", vectored ? " (vectored)" : "", elapsed_ms(&t0));
+  free_recording(&rec);
+  return failed;
+}
+
+void free_targets(struct target_set *t)
+{
+  free(t->pids);
+  *t = (struct target_set){ 0 };
+}
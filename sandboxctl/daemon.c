@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: MIT
+// sandboxctl daemon: attach policies to registered executables as they start.
+//
+// Exec events come from the proc connector. The new image (/proc/<pid>/exe)
+// is matched against the registry by device and inode, then by path, and its
+// policy is replayed from a cache of recorded load ioctls: an attach costs a
+// stat and one ioctl per function instead of a policy parse. The event is
+// delivered after execve() returns, so the process runs briefly before the
+// attach; `sandboxctl exec` is the race-free way to start a single program.
+// The module frees each policy when its process exits, so the daemon does
+// not track the pids it attached.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include "sandboxctl.h"
+
+// Identity of an executable file as the cache sees it
+struct exe_key {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  unsigned char build_id[64];
+  size_t build_id_len;
+};
+
+// One registry line: an executable and the policy to attach to it
+struct entry {
+  char *line;                // owns the strings below
+  const char *path;
+  struct policy_source src;
+  int embedded;              // no -j/-b/-e: the executable's own policy
+  dev_t dev;                 // of `path` when last looked up
+  ino_t ino;
+  int cached;
+  struct exe_key key;
+  struct policy_recording rec;
+};
+
+struct registry {
+  struct entry *entries;
+  size_t count;
+};
+
+static volatile sig_atomic_t reload, stop;
+
+static void on_signal(int sig)
+{
+  if (sig == SIGHUP) reload = 1;
+  else stop = 1;
+}
+
+static void free_registry(struct registry *r)
+{
+  for (size_t i = 0; i < r->count; ++i) {
+    free_recording(&r->entries[i].rec);
+    free(r->entries[i].line);
+  }
+  free(r->entries);
+  *r = (struct registry){ 0 };
+}
+
+static void stat_entry(struct entry *e)
+{
+  struct stat st;
+  if (stat(e->path, &st) == 0) {
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+  } else {
+    e->dev = 0;
+    e->ino = 0;
+  }
+}
+
+// Registry lines: <executable> [policy options], '#' starts a comment. The
+// options are those of `sandboxctl -p`; without -j/-b/-e the policy embedded
+// in the executable is loaded.
+static int load_registry(const char *path, struct registry *out)
+{
+  FILE *f = fopen(path, "r");
+  if (!f) { fprintf(stderr, "%s: %s\n", path, strerror(errno)); return -1; }
+  struct registry r = { 0 };
+  char *buf = NULL;
+  size_t cap = 0;
+  int lineno = 0, rc = 0;
+  while (rc == 0 && getline(&buf, &cap, f) >= 0) {
+    ++lineno;
+    char *hash = strchr(buf, '#');
+    if (hash) *hash = 0;
+    char *line = strdup(buf);
+    char *argv[64];
+    int argc = 0;
+    for (char *tok = line ? strtok(line, " \t\r\n") : NULL; tok && argc < 64; tok = strtok(NULL, " \t\r\n"))
+      argv[argc++] = tok;
+    if (argc == 0) { free(line); continue; }
+
+    struct entry e = { .line = line, .path = argv[0], .src = { .id_mode = ID_MODE_DUMMY } };
+    for (int i = 1; i < argc && rc == 0; ++i)
+      if (!parse_source_option(argc, argv, &i, &e.src)) {
+        fprintf(stderr, "%s:%d: unknown option %s\n", path, lineno, argv[i]);
+        rc = -1;
+      }
+    int sources = !!e.src.json_path + !!e.src.binary_path + !!e.src.exe_path;
+    if (rc == 0 && sources > 1) {
+      fprintf(stderr, "%s:%d: more than one of -j/-b/-e\n", path, lineno);
+      rc = -1;
+    }
+    struct entry *grown = rc == 0 ? realloc(r.entries, (r.count + 1) * sizeof(*grown)) : NULL;
+    if (!grown) {
+      if (rc == 0) { perror("realloc"); rc = -1; }
+      free(line);
+      break;
+    }
+    e.embedded = sources == 0;
+    stat_entry(&e);
+    r.entries = grown;
+    r.entries[r.count++] = e;
+  }
+  free(buf);
+  fclose(f);
+  if (rc) free_registry(&r);
+  else *out = r;
+  return rc;
+}
+
+// NT_GNU_BUILD_ID of a mapped ELF64 executable, from its PT_NOTE segments
+static size_t find_build_id(const char *elf, size_t size, unsigned char *id, size_t cap)
+{
+  const Elf64_Ehdr *eh = (const Elf64_Ehdr*)elf;
+  if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_phentsize != sizeof(Elf64_Phdr) ||
+      eh->e_phoff > size || (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > size - eh->e_phoff)
+    return 0;
+  const Elf64_Phdr *ph = (const Elf64_Phdr*)(elf + eh->e_phoff);
+  for (unsigned i = 0; i < eh->e_phnum; ++i) {
+    if (ph[i].p_type != PT_NOTE || ph[i].p_offset > size || ph[i].p_filesz > size - ph[i].p_offset)
+      continue;
+    const char *p = elf + ph[i].p_offset, *end = p + ph[i].p_filesz;
+    while ((size_t)(end - p) >= sizeof(Elf64_Nhdr)) {
+      const Elf64_Nhdr *n = (const Elf64_Nhdr*)p;
+      size_t name_sz = (n->n_namesz + 3) & ~3u, desc_sz = (n->n_descsz + 3) & ~3u;
+      if ((size_t)(end - p) - sizeof(*n) < name_sz + desc_sz) break;
+      const char *name = p + sizeof(*n);
+      if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 && !memcmp(name, "GNU", 4) &&
+          n->n_descsz <= cap) {
+        memcpy(id, name + name_sz, n->n_descsz);
+        return n->n_descsz;
+      }
+      p += sizeof(*n) + name_sz + desc_sz;
+    }
+  }
+  return 0;
+}
+
+static void exe_build_id(const char *exe, struct exe_key *key)
+{
+  key->build_id_len = 0;
+  int fd = open(exe, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  void *m = key->size > 0 ? mmap(NULL, (size_t)key->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (m == MAP_FAILED) return;
+  key->build_id_len = find_build_id(m, (size_t)key->size, key->build_id, sizeof(key->build_id));
+  munmap(m, (size_t)key->size);
+}
+
+static int same_file(const struct exe_key *a, const struct exe_key *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static struct entry *match_entry(struct registry *r, const char *exe, const struct stat *st)
+{
+  for (size_t i = 0; i < r->count; ++i)
+    if (r->entries[i].dev == st->st_dev && r->entries[i].ino == st->st_ino) return &r->entries[i];
+
+  // Replaced since it was last looked up (package upgrade): match the path
+  char path[4096];
+  ssize_t n = readlink(exe, path, sizeof(path) - 1);
+  if (n <= 0) return NULL;
+  path[n] = 0;
+  for (size_t i = 0; i < r->count; ++i) {
+    struct entry *e = &r->entries[i];
+    if (strcmp(e->path, path)) continue;
+    stat_entry(e);
+    if (e->dev == st->st_dev && e->ino == st->st_ino) return e;
+  }
+  return NULL;
+}
+
+// Attach the policy registered for the image `pid` just exec'd, if any
+static void on_exec(int fd, struct registry *r, pid_t pid, int quiet)
+{
+  char exe[64];
+  struct stat st;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  snprintf(exe, sizeof(exe), "/proc/%d/exe", (int)pid);
+  if (stat(exe, &st) != 0) return; // already gone
+  struct entry *e = match_entry(r, exe, &st);
+  if (!e) return;
+
+  struct exe_key key = { .dev = st.st_dev, .ino = st.st_ino, .mtime = st.st_mtim, .size = st.st_size };
+  const char *how = "cached";
+  if (!e->cached || !same_file(&e->key, &key)) {
+    // Same build under another inode (reinstalled, copied): keep the policy
+    exe_build_id(exe, &key);
+    if (e->cached && key.build_id_len && key.build_id_len == e->key.build_id_len &&
+        !memcmp(key.build_id, e->key.build_id, key.build_id_len)) {
+      how = "cached (build-id)";
+    } else {
+      struct policy_source src = e->src;
+      if (e->embedded) src.exe_path = exe; // the image that is running
+      free_recording(&e->rec);
+      e->cached = 0;
+      if (record_policy(&src, &e->rec) != 0) {
+        fprintf(stderr, "pid %d (%s): no policy loaded\n", (int)pid, e->path);
+        return;
+      }
+      e->cached = 1;
+      how = "compiled";
+    }
+    e->key = key;
+  }
+
+  if (replay_policy(fd, pid, &e->rec) != 0) {
+    fprintf(stderr, "pid %d (%s): load failed: %s\n", (int)pid, e->path, strerror(errno));
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (!quiet)
+    printf("attached pid=%d exe=%s ioctls=%zu %s %.0fus\n", (int)pid, e->path, e->rec.count, how,
+           (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+}
+
+// Netlink socket subscribed to process events
+static int proc_connect(void)
+{
+  int sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (sk < 0) { perror("socket(NETLINK_CONNECTOR)"); return -1; }
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+  if (bind(sk, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+    perror("bind proc connector");
+    close(sk);
+    return -1;
+  }
+
+  struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+    struct nlmsghdr nl;
+    struct __attribute__((packed)) {
+      struct cn_msg cn;
+      enum proc_cn_mcast_op op;
+    };
+  } msg = { 0 };
+  msg.nl.nlmsg_len = sizeof(msg);
+  msg.nl.nlmsg_type = NLMSG_DONE;
+  msg.cn.id.idx = CN_IDX_PROC;
+  msg.cn.id.val = CN_VAL_PROC;
+  msg.cn.len = sizeof(enum proc_cn_mcast_op);
+  msg.op = PROC_CN_MCAST_LISTEN;
+  if (send(sk, &msg, sizeof(msg), 0) < 0) {
+    perror("proc connector listen (needs CAP_NET_ADMIN)");
+    close(sk);
+    return -1;
+  }
+  return sk;
+}
+
+static void daemon_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s daemon -r <registry> [-q]\n", argv0);
+  fprintf(stderr, "Attaches policies to registered executables when they are exec'd.\n");
+  fprintf(stderr, "Registry lines: <executable> [-j <json>|-b <lcpb>|-e <exe>] [-f ...] [--global] ...;\n"
+                  "without -j/-b/-e the executable's embedded policy is used. SIGHUP rereads the\n"
+                  "registry and drops the policy cache.\n");
+}
+
+int daemon_main(int argc, char **argv)
+{
+  const char *registry_path = NULL;
+  int quiet = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-r") && i + 1 < argc) registry_path = argv[++i];
+    else if (!strcmp(argv[i], "-q")) quiet = 1;
+    else { daemon_usage("sandboxctl"); return 1; }
+  }
+  if (!registry_path) { daemon_usage("sandboxctl"); return 1; }
+
+  struct registry reg;
+  if (load_registry(registry_path, &reg) != 0) return 1;
+  int fd = open(DEVICE_PATH, O_RDWR | O_CLOEXEC);
+  if (fd < 0) { perror("open /dev/libcallsandbox"); free_registry(&reg); return 1; }
+  int sk = proc_connect();
+  if (sk < 0) { close(fd); free_registry(&reg); return 1; }
+
+  struct sigaction sa = { .sa_handler = on_signal }; // no SA_RESTART: recv() returns EINTR
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (!quiet) printf("watching %zu executables from %s\n", reg.count, registry_path);
+
+  char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+  while (!stop) {
+    if (reload) {
+      struct registry fresh;
+      reload = 0;
+      if (load_registry(registry_path, &fresh) == 0) {
+        free_registry(&reg);
+        reg = fresh;
+        if (!quiet) printf("reloaded %zu executables\n", reg.count);
+      }
+    }
+    ssize_t len = recv(sk, buf, sizeof(buf), 0);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == ENOBUFS) { fprintf(stderr, "proc connector overrun: exec events lost\n"); continue; }
+      perror("recv");
+      break;
+    }
+    for (struct nlmsghdr *nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+      if (nl->nlmsg_type == NLMSG_NOOP || nl->nlmsg_type == NLMSG_ERROR) continue;
+      struct cn_msg *cn = NLMSG_DATA(nl);
+      struct proc_event *ev = (struct proc_event*)cn->data;
+      if (cn->id.idx == CN_IDX_PROC && ev->what == PROC_EVENT_EXEC)
+        on_exec(fd, &reg, ev->event_data.exec.process_tgid, quiet);
+    }
+  }
+
+  close(sk);
+  close(fd);
+  free_registry(&reg);
+  return 0;
+}
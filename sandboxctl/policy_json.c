@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: MIT
+// Recursive-descent tokenizer over the mapped policy file. Every byte is
+// looked at once; entries other than the requested function are skipped by
+// bracket depth without decoding or allocating, and the buffers holding one
+// function are reused for the next.
+#include "policy_json.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The kernel's MAX_CHECKPOINTS; the reach matrix is quadratic in it
+#define JSON_MAX_CHECKPOINTS 8192
+
+struct slice {
+  const char *s;
+  size_t n;
+};
+
+struct parser {
+  const char *p;
+  const char *end;
+  int id_mode;
+  struct json_function f;
+  // Reused across functions
+  size_t edges_cap;
+  char *name;
+  size_t name_cap;
+  struct slice start;
+  struct slice *reach;
+  size_t reach_n, reach_cap;
+  size_t rows_cap;
+};
+
+static int grow(void *pp, size_t *cap, size_t need, size_t elem)
+{
+  void **p = pp;
+  if (need <= *cap) return 0;
+  size_t n = *cap ? *cap : 16;
+  while (n < need) n *= 2;
+  void *q = realloc(*p, n * elem);
+  if (!q) return -1;
+  *p = q;
+  *cap = n;
+  return 0;
+}
+
+static int key_is(struct slice key, const char *s)
+{
+  return key.n == strlen(s) && !memcmp(key.s, s, key.n);
+}
+
+static void skip_ws(struct parser *P)
+{
+  while (P->p < P->end && (*P->p == ' ' || *P->p == '\n' || *P->p == '\r' || *P->p == '\t'))
+    P->p++;
+}
+
+// Consume `ch` after optional whitespace
+static int accept(struct parser *P, char ch)
+{
+  skip_ws(P);
+  if (P->p < P->end && *P->p == ch) { P->p++; return 1; }
+  return 0;
+}
+
+// String body without the quotes; escapes are left in place
+static int parse_string(struct parser *P, struct slice *out)
+{
+  skip_ws(P);
+  if (P->p >= P->end || *P->p != '"') return -1;
+  const char *s = ++P->p;
+  while (P->p < P->end && *P->p != '"') {
+    if (*P->p == '\\') P->p++;
+    P->p++;
+  }
+  if (P->p >= P->end) return -1;
+  out->s = s;
+  out->n = (size_t)(P->p - s);
+  P->p++;
+  return 0;
+}
+
+// Integers only: the pass writes no fractions or exponents
+static int parse_int(struct parser *P, long long *out)
+{
+  skip_ws(P);
+  int neg = P->p < P->end && *P->p == '-';
+  if (neg) P->p++;
+  const char *digits = P->p;
+  long long v = 0;
+  while (P->p < P->end && *P->p >= '0' && *P->p <= '9') {
+    if (v > (LLONG_MAX - 9) / 10) return -1;
+    v = v * 10 + (*P->p++ - '0');
+  }
+  if (P->p == digits) return -1;
+  *out = neg ? -v : v;
+  return 0;
+}
+
+static int parse_u32(struct parser *P, uint32_t *out)
+{
+  long long v;
+  if (parse_int(P, &v) || v < 0 || v > UINT32_MAX) return -1;
+  *out = (uint32_t)v;
+  return 0;
+}
+
+static int skip_value(struct parser *P)
+{
+  struct slice s;
+  skip_ws(P);
+  if (P->p >= P->end) return -1;
+  if (*P->p == '"') return parse_string(P, &s);
+  if (*P->p != '{' && *P->p != '[') {
+    // number, true, false or null
+    const char *start = P->p;
+    while (P->p < P->end && !strchr(",]} \n\r\t", *P->p)) P->p++;
+    return P->p == start ? -1 : 0;
+  }
+  size_t depth = 0;
+  while (P->p < P->end) {
+    char ch = *P->p;
+    if (ch == '"') {
+      if (parse_string(P, &s)) return -1;
+      continue;
+    }
+    P->p++;
+    if (ch == '{' || ch == '[') depth++;
+    else if ((ch == '}' || ch == ']') && --depth == 0) return 0;
+  }
+  return -1;
+}
+
+// Member loop over an object whose '{' was consumed. Start with *first = 1;
+// returns 1 with `key` read and ':' consumed, 0 at '}', -1 on error.
+static int next_member(struct parser *P, int *first, struct slice *key)
+{
+  if (accept(P, '}')) return 0;
+  if (!*first && !accept(P, ',')) return -1;
+  *first = 0;
+  if (parse_string(P, key) || !accept(P, ':')) return -1;
+  return 1;
+}
+
+// Same for the elements of an array whose '[' was consumed
+static int next_element(struct parser *P, int *first)
+{
+  if (accept(P, ']')) return 0;
+  if (!*first && !accept(P, ',')) return -1;
+  *first = 0;
+  return 1;
+}
+
+static int is_epsilon(struct slice label)
+{
+  return (label.n == 2 && !memcmp(label.s, "\xcf\xb5", 2)) ||
+         (label.n == 6 && !memcmp(label.s, "\\u03f5", 6));
+}
+
+static int parse_edge(struct parser *P, struct lcpb_edge *e)
+{
+  long long dummy = -1, unique = -1;
+  uint32_t src = UINT32_MAX, dst = UINT32_MAX;
+  struct slice key, label = { "", 0 };
+  int first = 1, r;
+  if (!accept(P, '{')) return -1;
+  while ((r = next_member(P, &first, &key)) == 1) {
+    if (key_is(key, "src")) r = parse_u32(P, &src);
+    else if (key_is(key, "dst")) r = parse_u32(P, &dst);
+    else if (key_is(key, "label")) r = parse_string(P, &label);
+    else if (key_is(key, "matchDummy")) r = parse_int(P, &dummy);
+    else if (key_is(key, "matchUnique")) r = parse_int(P, &unique);
+    else r = skip_value(P);
+    if (r) return -1;
+  }
+  if (r < 0 || src == UINT32_MAX || dst == UINT32_MAX) return -1;
+  e->src = src;
+  e->dst = dst;
+  e->is_epsilon = (uint8_t)is_epsilon(label);
+  e->match_id = e->is_epsilon ? -1 : (int32_t)(P->id_mode == LCPB_ID_DUMMY ? dummy : unique);
+  return 0;
+}
+
+static int parse_edges(struct parser *P)
+{
+  int first = 1, r;
+  if (!accept(P, '[')) return -1;
+  while ((r = next_element(P, &first)) == 1) {
+    if (grow(&P->f.edges, &P->edges_cap, P->f.num_edges + 1, sizeof(struct lcpb_edge)) ||
+        parse_edge(P, &P->f.edges[P->f.num_edges]))
+      return -1;
+    P->f.num_edges++;
+  }
+  return r;
+}
+
+// Elements are counted, not decoded, so labels may contain anything
+static int count_elements(struct parser *P, uint32_t *n)
+{
+  int first = 1, r;
+  *n = 0;
+  if (!accept(P, '[')) return -1;
+  while ((r = next_element(P, &first)) == 1) {
+    if (skip_value(P)) return -1;
+    ++*n;
+  }
+  return r;
+}
+
+// Hex bitset as the pass writes it: four bits per digit, lowest first
+static int parse_hex_row(struct slice s, uint64_t *row, size_t words)
+{
+  for (size_t k = 0; k < s.n; ++k) {
+    char c = s.s[k];
+    int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (v < 0 || (v && 4 * k >= words * 64)) return -1;
+    if (v) row[(4 * k) / 64] |= (uint64_t)v << ((4 * k) % 64);
+  }
+  return 0;
+}
+
+static int parse_checkpoints(struct parser *P)
+{
+  struct slice key;
+  int first = 1, r;
+  uint32_t count = 0;
+  P->start.n = 0;
+  P->reach_n = 0;
+  if (!accept(P, '{')) return -1;
+  while ((r = next_member(P, &first, &key)) == 1) {
+    if (key_is(key, "count")) r = parse_u32(P, &count);
+    else if (key_is(key, "start")) r = parse_string(P, &P->start);
+    else if (key_is(key, "reach")) {
+      int efirst = 1;
+      if (!accept(P, '[')) return -1;
+      while ((r = next_element(P, &efirst)) == 1) {
+        if (grow(&P->reach, &P->reach_cap, P->reach_n + 1, sizeof(struct slice)) ||
+            parse_string(P, &P->reach[P->reach_n]))
+          return -1;
+        P->reach_n++;
+      }
+    } else r = skip_value(P);
+    if (r) return -1;
+  }
+  if (r < 0 || count > JSON_MAX_CHECKPOINTS || P->reach_n != count) return -1;
+
+  size_t words = LCPB_ROW_WORDS(count);
+  size_t n = (count + 1) * words;
+  if (grow(&P->f.rows, &P->rows_cap, n, sizeof(uint64_t))) return -1;
+  memset(P->f.rows, 0, n * sizeof(uint64_t));
+  if (parse_hex_row(P->start, P->f.rows, words)) return -1;
+  for (uint32_t i = 0; i < count; ++i)
+    if (parse_hex_row(P->reach[i], P->f.rows + (i + 1) * words, words)) return -1;
+  P->f.has_checkpoints = 1;
+  P->f.num_checkpoints = count;
+  return 0;
+}
+
+static int parse_function(struct parser *P, uint32_t index)
+{
+  struct slice key, name = { "", 0 };
+  int first = 1, r;
+  P->f.index = index;
+  P->f.id_mode = -1;
+  P->f.has_key = 0;
+  P->f.num_nodes = 0;
+  P->f.num_edges = 0;
+  P->f.has_checkpoints = 0;
+  P->f.num_checkpoints = 0;
+  if (!accept(P, '{')) return -1;
+  while ((r = next_member(P, &first, &key)) == 1) {
+    if (key_is(key, "functionName")) r = parse_string(P, &name);
+    else if (key_is(key, "funcKey")) {
+      r = parse_u32(P, &P->f.func_key);
+      P->f.has_key = !r;
+    }
+    else if (key_is(key, "idMode")) {
+      struct slice mode;
+      if (!(r = parse_string(P, &mode)))
+        P->f.id_mode = key_is(mode, "global") ? LCPB_ID_GLOBAL : key_is(mode, "unique") ? LCPB_ID_UNIQUE :
+                       key_is(mode, "dummy") ? LCPB_ID_DUMMY : -1;
+    }
+    else if (key_is(key, "nodeLabels")) r = count_elements(P, &P->f.num_nodes);
+    else if (key_is(key, "edges")) r = parse_edges(P);
+    else if (key_is(key, "checkpoints")) r = parse_checkpoints(P);
+    else r = skip_value(P);
+    if (r) return -1;
+  }
+  if (r < 0 || grow(&P->name, &P->name_cap, name.n + 1, 1)) return -1;
+  memcpy(P->name, name.s, name.n);
+  P->name[name.n] = 0;
+  P->f.name = P->name;
+  return 0;
+}
+
+int parse_policy_json(const char *buf, size_t len, int id_mode, int want,
+                      json_function_cb cb, void *ctx, size_t *err_offset)
+{
+  struct parser P = { .p = buf, .end = buf + len, .id_mode = id_mode };
+  struct slice key;
+  int first = 1, r = -1, rc = 0;
+
+  if (!accept(&P, '{')) goto out;
+  while ((r = next_member(&P, &first, &key)) == 1) {
+    if (!key_is(key, "functions")) {
+      if (skip_value(&P)) { r = -1; break; }
+      continue;
+    }
+    int efirst = 1;
+    uint32_t index = 0;
+    if (!accept(&P, '[')) { r = -1; break; }
+    while ((r = next_element(&P, &efirst)) == 1) {
+      if (want >= 0 && index != (uint32_t)want) {
+        r = skip_value(&P);
+      } else {
+        r = parse_function(&P, index);
+        if (!r) rc = cb(&P.f, ctx);
+        if (!r && (rc || want >= 0)) goto out; // done; the rest is not read
+      }
+      if (r) break;
+      index++;
+    }
+    if (r < 0) break;
+  }
+
+out:
+  if (r < 0) {
+    *err_offset = (size_t)(P.p - buf);
+    rc = -1;
+  }
+  free(P.f.edges);
+  free(P.f.rows);
+  free(P.name);
+  free(P.reach);
+  return rc;
+}
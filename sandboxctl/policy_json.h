@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+// Single-pass reader for the policy JSON written by LibCallPass / libcall-link.
+#ifndef SANDBOXCTL_POLICY_JSON_H
+#define SANDBOXCTL_POLICY_JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Policy/PolicyFormat.h"
+
+// One entry of the "functions" array, in the kernel's layout. Only valid
+// during the callback.
+struct json_function {
+  uint32_t index;            // position in the array
+  const char *name;          // NUL-terminated
+  int id_mode;               // LCPB_ID_* from "idMode", -1 if absent
+  int has_key;
+  uint32_t func_key;
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  struct lcpb_edge *edges;   // match_id of the requested ID mode
+  int has_checkpoints;
+  uint32_t num_checkpoints;
+  uint64_t *rows;            // (num_checkpoints + 1) * LCPB_ROW_WORDS rows
+};
+
+// Return non-zero to stop the walk; parse_policy_json() then returns it.
+typedef int (*json_function_cb)(const struct json_function *f, void *ctx);
+
+// Walk the document in `buf` (not NUL-terminated) once, calling `cb` for
+// function `want`, or for every function when `want` is negative. Other
+// entries are skipped without being decoded. Returns 0, the callback's
+// non-zero result, or -1 on a syntax error with *err_offset set.
+int parse_policy_json(const char *buf, size_t len, int id_mode, int want,
+                      json_function_cb cb, void *ctx, size_t *err_offset);
+
+#endif
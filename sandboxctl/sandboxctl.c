@@ -1,220 +1,648 @@
 
 // SPDX-License-Identifier: MIT
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <ctype.h>
+#include <signal.h>
+#include <elf.h>
 
-#define DEVICE_PATH "/dev/libcallsandbox"
-#define IOCTL_MAGIC 'L'
-#define IOCTL_LOAD_POLICY _IOW(IOCTL_MAGIC, 0x01, void*)
-
-struct edge {
-  uint32_t src;
-  uint32_t dst;
-  int32_t  match_id;
-  uint8_t  is_epsilon;
-} __attribute__((packed));
-
-struct policy_blob {
-  uint32_t pid;
-  uint32_t num_nodes;
-  uint32_t num_edges;
-  uint32_t id_mode; // 0=dummy 1=unique
+#include "Policy/PolicyFormat.h"
+#include "policy_json.h"
+#include "sandboxctl.h"
+
+// Set while record_policy() runs: blobs are kept instead of reaching the kernel
+static struct policy_recording *recording;
+
+// printf() for progress messages, quiet while recording
+static void report(const char *fmt, ...)
+{
+  va_list ap;
+  if (recording) return;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+// The device the load ioctls go to. Nothing reaches it while recording, so
+// then it need not exist.
+static int open_device(void)
+{
+  int fd = open(DEVICE_PATH, O_RDWR);
+  if (fd < 0 && recording) fd = open("/dev/null", O_RDONLY);
+  if (fd < 0) perror("open " DEVICE_PATH);
+  return fd;
+}
+
+// Issue one load ioctl, or record it. Takes ownership of `blob`.
+static int submit(int fd, unsigned long cmd, void *blob, size_t size, const char *what)
+{
+  if (recording) {
+    struct recorded_ioctl *grown = realloc(recording->calls, (recording->count + 1) * sizeof(*grown));
+    if (!grown) { perror("realloc"); free(blob); return -1; }
+    recording->calls = grown;
+    grown[recording->count++] = (struct recorded_ioctl){ cmd, size, blob };
+    return 0;
+  }
+  int rc = ioctl(fd, cmd, blob);
+  if (rc != 0) perror(what);
+  free(blob);
+  return rc ? -1 : 0;
+}
+
+// Hand one automaton to the kernel; func_key is only used with global IDs
+static int send_automaton(int fd, pid_t pid, int id_mode, uint32_t func_key,
+                          uint32_t num_nodes, uint32_t num_edges, const void *edges)
+{
+  size_t edges_sz = num_edges * sizeof(struct lcpb_edge);
+  size_t hdr_sz;
+  unsigned long cmd;
+  struct policy_blob hdr = {
+    .pid = (uint32_t)pid,
+    .num_nodes = num_nodes,
+    .num_edges = num_edges,
+    .id_mode = (uint32_t)id_mode
+  };
+  struct policy_blob_v2 hdr2 = {
+    .pid = (uint32_t)pid,
+    .num_nodes = num_nodes,
+    .num_edges = num_edges,
+    .id_mode = ID_MODE_GLOBAL,
+    .func_key = func_key,
+  };
+  const void *hdrp;
+  if (id_mode == ID_MODE_GLOBAL) {
+    hdrp = &hdr2; hdr_sz = sizeof(hdr2); cmd = IOCTL_LOAD_FUNC_POLICY;
+  } else {
+    hdrp = &hdr; hdr_sz = sizeof(hdr); cmd = IOCTL_LOAD_POLICY;
+  }
+
+  void *blob = malloc(hdr_sz + edges_sz);
+  if (!blob) { perror("malloc"); return -1; }
+  memcpy(blob, hdrp, hdr_sz);
+  memcpy((char*)blob + hdr_sz, edges, edges_sz);
+  return submit(fd, cmd, blob, hdr_sz + edges_sz, "ioctl load policy");
+}
+
+static const char *const mode_names[] = {"dummy", "unique", "global"};
+
+// Hand (count + 1) rows of checkpoint bitsets to the kernel
+static int send_checkpoints(int fd, pid_t pid, uint32_t count, int global, uint32_t func_key,
+                            const uint64_t *rows)
+{
+  size_t rows_sz = (count + 1) * ((count + 63) / 64) * sizeof(uint64_t);
+  char *blob = malloc(sizeof(struct checkpoint_blob) + rows_sz);
+  if (!blob) { perror("malloc"); return -1; }
+  struct checkpoint_blob hdr = { .pid = (uint32_t)pid, .num_checkpoints = count };
+  if (global) {
+    hdr.func_key = func_key;
+    hdr.flags = CHECKPOINT_GLOBAL;
+  }
+  memcpy(blob, &hdr, sizeof(hdr));
+  memcpy(blob + sizeof(hdr), rows, rows_sz);
+  return submit(fd, IOCTL_LOAD_CHECKPOINTS, blob, sizeof(hdr) + rows_sz, "ioctl load checkpoints");
+}
+
+static int in_bounds(size_t size, uint64_t off, uint64_t len)
+{
+  return off <= size && len <= size - off;
+}
+
+// Check that an LCPB image's tables lie within its first `avail` bytes
+static int lcpb_valid(const struct lcpb_header *h, size_t avail)
+{
+  const char *base = (const char*)h;
+  if (avail < sizeof(*h) || memcmp(h->magic, LCPB_MAGIC, 4) != 0 || h->version != LCPB_VERSION ||
+      h->total_size < sizeof(*h) || h->total_size > avail || h->id_mode > LCPB_ID_GLOBAL)
+    return 0;
+  size_t size = (size_t)h->total_size;
+  return in_bounds(size, h->functions_offset, (uint64_t)h->num_functions * sizeof(struct lcpb_function)) &&
+         in_bounds(size, h->automata_offset, (uint64_t)h->num_automata * sizeof(struct lcpb_automaton)) &&
+         in_bounds(size, h->index_offset, (uint64_t)h->num_buckets * sizeof(struct lcpb_bucket)) &&
+         (h->num_buckets & (h->num_buckets - 1)) == 0 &&
+         in_bounds(size, h->strings_offset, h->strings_size) &&
+         (!h->strings_size || base[h->strings_offset + h->strings_size - 1] == 0);
+}
+
+// Position of the function named `name` in an image, from its name index
+static long lcpb_find(const struct lcpb_header *h, const char *name)
+{
+  const char *base = (const char*)h;
+  const struct lcpb_bucket *index = (const struct lcpb_bucket*)(base + h->index_offset);
+  const struct lcpb_function *fns = (const struct lcpb_function*)(base + h->functions_offset);
+  uint32_t hash = lcpb_name_hash(name), mask = h->num_buckets - 1;
+  for (uint32_t i = 0, b = hash & mask; i < h->num_buckets; ++i, b = (b + 1) & mask) {
+    uint32_t f = index[b].function;
+    if (f == LCPB_NO_FUNCTION) break;
+    if (index[b].hash == hash && f < h->num_functions && fns[f].name_offset < h->strings_size &&
+        !strcmp(base + h->strings_offset + fns[f].name_offset, name))
+      return f;
+  }
+  return -1;
+}
+
+static char *map_file(const char *path, size_t *size_out)
+{
+  int mfd = open(path, O_RDONLY);
+  if (mfd < 0) return NULL;
+  struct stat st;
+  if (fstat(mfd, &st) != 0) { close(mfd); return NULL; }
+  if (st.st_size == 0) { close(mfd); errno = EINVAL; return NULL; }
+  void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, mfd, 0);
+  close(mfd);
+  if (m == MAP_FAILED) return NULL;
+  *size_out = (size_t)st.st_size;
+  return m;
+}
+
+// The .libcall_policy section of a mapped ELF64 file (-libcall-embed)
+static const char *find_policy_section(const char *elf, size_t size, size_t *sec_size)
+{
+  static const char name[] = ".libcall_policy";
+  const Elf64_Ehdr *eh = (const Elf64_Ehdr*)elf;
+  if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_shentsize != sizeof(Elf64_Shdr) ||
+      eh->e_shstrndx >= eh->e_shnum ||
+      !in_bounds(size, eh->e_shoff, (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr)))
+    return NULL;
+  const Elf64_Shdr *sh = (const Elf64_Shdr*)(elf + eh->e_shoff);
+  const Elf64_Shdr *names = &sh[eh->e_shstrndx];
+  if (!in_bounds(size, names->sh_offset, names->sh_size)) return NULL;
+  for (unsigned i = 0; i < eh->e_shnum; ++i) {
+    if (sh[i].sh_type == SHT_NOBITS || !in_bounds(names->sh_size, sh[i].sh_name, sizeof(name)) ||
+        memcmp(elf + names->sh_offset + sh[i].sh_name, name, sizeof(name)) != 0)
+      continue;
+    if (!in_bounds(size, sh[i].sh_offset, sh[i].sh_size)) return NULL;
+    *sec_size = sh[i].sh_size;
+    return elf + sh[i].sh_offset;
+  }
+  return NULL;
+}
+
+struct image {
+  const struct lcpb_header *h;
+  size_t size;
 };
 
-// Very small JSON extractor (expects the JSON emitted by the LLVM pass)
-static char* slurp(const char* path, size_t *len_out) {
-  FILE *f = fopen(path, "rb");
-  if (!f) return NULL;
-  fseek(f, 0, SEEK_END);
-  long n = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  char *buf = (char*)malloc(n+1);
-  if (!buf) { fclose(f); return NULL; }
-  if (fread(buf, 1, n, f) != (size_t)n) { fclose(f); free(buf); return NULL; }
-  buf[n] = 0;
-  fclose(f);
-  if (len_out) *len_out = (size_t)n;
-  return buf;
-}
-
-static int find_value(const char *json, const char *key, char *out, size_t outsz) {
-  const char *p = strstr(json, key);
-  if (!p) return -1;
-  p = strchr(p, ':');
-  if (!p) return -1;
-  p++;
-  while (isspace((unsigned char)*p)) p++;
-  const char *q = p;
-  int in_string = (*q == '"');
-  if (in_string) { q++; p = q; while (*q && *q != '"') q++; }
-  else { while (*q && *q != ',' && *q != ']' && *q != '}') q++; }
-  size_t n = (size_t)(q - p);
-  if (n >= outsz) n = outsz - 1;
-  memcpy(out, p, n);
-  out[n] = 0;
+// The linker concatenates one image per object file, each 8-byte aligned, so
+// zero padding may sit between them
+static struct image *split_images(const char *sec, size_t sec_size, size_t *n_out)
+{
+  static const uint64_t zero;
+  struct image *imgs = NULL;
+  size_t n = 0, off = 0;
+  while (off + sizeof(uint64_t) <= sec_size) {
+    if (!memcmp(sec + off, &zero, sizeof(zero))) { off += sizeof(zero); continue; }
+    const struct lcpb_header *h = (const struct lcpb_header*)(sec + off);
+    struct image *grown = lcpb_valid(h, sec_size - off) ? realloc(imgs, (n + 1) * sizeof(*imgs)) : NULL;
+    if (!grown) { free(imgs); return NULL; }
+    imgs = grown;
+    imgs[n++] = (struct image){ h, (size_t)h->total_size };
+    off += (h->total_size + 7) & ~(uint64_t)7;
+  }
+  *n_out = n;
+  return imgs;
+}
+
+// Set of loaded function keys. With -libcall-embed every translation unit
+// carries its own copy of inline (linkonce) functions; the first one wins.
+static int key_seen(uint32_t *keys, uint8_t *used, size_t cap, uint32_t key)
+{
+  size_t i = key & (cap - 1);
+  for (; used[i]; i = (i + 1) & (cap - 1))
+    if (keys[i] == key) return 1;
+  used[i] = 1;
+  keys[i] = key;
   return 0;
 }
 
-// Parse one function's graph from JSON into edges (matching by id mode)
-static int extract_graph_edges(const char *json, int func_index,
-                               int id_mode, uint32_t **edges_out, uint32_t *num_edges_out,
-                               uint32_t *num_nodes_out)
-{
-  // Find the Nth occurrence of "\"edges\": [" and then scan entries
-  const char *p = json;
-  for (int i = 0; i <= func_index; ++i) {
-    p = strstr(p, "\"edges\":");
-    if (!p) return -1;
-    p += 8;
-  }
-  const char *start = strchr(p, '[');
-  const char *end = strchr(start, ']');
-  if (!start || !end || end <= start) return -1;
-
-  // Also get node counts by scanning "nodeLabels"
-  const char *nl = strstr(p, "\"nodeLabels\":");
-  if (!nl) return -1;
-  const char *nlb = strchr(nl, '[');
-  const char *nle = strchr(nlb, ']');
-  if (!nlb || !nle) return -1;
-
-  // Count nodes
-  uint32_t nodes = 0;
-  for (const char *t = nlb; t < nle; ++t) if (*t == ',') nodes++;
-  // nodes = commas + 1 if non-empty
-  if (nle - nlb > 2) nodes = nodes + 1; else nodes = 0;
-  *num_nodes_out = nodes;
-
-  // Count edges by commas/braces
-  uint32_t edges_count = 0;
-  for (const char *t = start; t < end; ++t) if (*t == '{') edges_count++;
-  struct edge *edges = (struct edge*)calloc(edges_count, sizeof(struct edge));
-  if (!edges) return -1;
-
-  // Crude parse loop
-  uint32_t idx = 0;
-  const char *cur = start;
-  while (cur && cur < end) {
-    const char *es = strchr(cur, '{');
-    if (!es || es >= end) break;
-    const char *ee = strchr(es, '}');
-    if (!ee) break;
-    char buf[64];
-    // src
-    strncpy(buf, "", sizeof(buf));
-    const char *field = strstr(es, "\"src\"");
-    if (field && field < ee && find_value(field, "src", buf, sizeof(buf)) == 0) {
-      edges[idx].src = (uint32_t)atoi(buf);
+// Load function `index` of a mapped LCPB image; the image fixes the ID mode
+static int load_binary_function(int fd, const struct lcpb_header *h, size_t size, pid_t pid,
+                                uint32_t index, int checkpoints)
+{
+  const char *base = (const char*)h;
+  const struct lcpb_function *fn = (const struct lcpb_function*)(base + h->functions_offset) + index;
+  if (fn->automaton >= h->num_automata || fn->name_offset >= h->strings_size) {
+    fprintf(stderr, "Malformed function entry %u\n", index);
+    return -1;
+  }
+  const struct lcpb_automaton *a = (const struct lcpb_automaton*)(base + h->automata_offset) + fn->automaton;
+  const char *name = base + h->strings_offset + fn->name_offset;
+  int global = h->id_mode == LCPB_ID_GLOBAL;
+
+  if (checkpoints) {
+    if (!a->rows_offset) {
+      fprintf(stderr, "No checkpoints for %s (policy built without -libcall-checkpoints?)\n", name);
+      return -1;
     }
-    // dst
-    strncpy(buf, "", sizeof(buf));
-    field = strstr(es, "\"dst\"");
-    if (field && field < ee && find_value(field, "dst", buf, sizeof(buf)) == 0) {
-      edges[idx].dst = (uint32_t)atoi(buf);
+    if (a->num_checkpoints == 0) {
+      report("%s has no checkpoints; nothing to load\n", name);
+      return 0;
     }
-    // label
-    strncpy(buf, "", sizeof(buf));
-    field = strstr(es, "\"label\"");
-    if (field && field < ee && find_value(field, "label", buf, sizeof(buf)) == 0) {
-      if (strcmp(buf, "\"ϵ\"") == 0 || strcmp(buf, "ϵ") == 0) {
-        edges[idx].is_epsilon = 1;
-      }
+    uint64_t rows_sz = ((uint64_t)a->num_checkpoints + 1) * LCPB_ROW_WORDS(a->num_checkpoints) * sizeof(uint64_t);
+    if (!in_bounds(size, a->rows_offset, rows_sz)) {
+      fprintf(stderr, "Checkpoint rows of %s out of bounds\n", name);
+      return -1;
     }
-    // match ids
-    strncpy(buf, "", sizeof(buf));
-    if (id_mode == 0) { // dummy
-      field = strstr(es, "\"matchDummy\"");
-    } else {
-      field = strstr(es, "\"matchUnique\"");
+    if (send_checkpoints(fd, pid, a->num_checkpoints, global, fn->func_key,
+                         (const uint64_t*)(base + a->rows_offset)) != 0)
+      return -1;
+    report("Loaded checkpoints: pid=%d function=%s checkpoints=%u%s\n",
+           pid, name, a->num_checkpoints, global ? " (global)" : "");
+    return 0;
+  }
+
+  if (!in_bounds(size, a->edges_offset, (uint64_t)a->num_edges * sizeof(struct lcpb_edge))) {
+    fprintf(stderr, "Edges of %s out of bounds\n", name);
+    return -1;
+  }
+  if (send_automaton(fd, pid, (int)h->id_mode, fn->func_key, a->num_nodes, a->num_edges,
+                     base + a->edges_offset) != 0)
+    return -1;
+  report("Loaded policy: pid=%d function=%s nodes=%u edges=%u mode=%s\n",
+         pid, name, a->num_nodes, a->num_edges, mode_names[h->id_mode]);
+  return 0;
+}
+
+struct json_load {
+  int fd;
+  pid_t pid;
+  int id_mode;
+  int checkpoints;
+  const char *name; // load only the function of this name
+  int loaded;
+};
+
+// Callback result that ends the walk once a function picked by name is loaded;
+// errors return 1 so neither is mistaken for a syntax error (-1)
+#define JSON_DONE 2
+
+// parse_policy_json() callback: hand one function to the kernel
+static int load_json_function(const struct json_function *f, void *ctx)
+{
+  struct json_load *L = ctx;
+  int global = L->id_mode == ID_MODE_GLOBAL;
+  if (L->name && strcmp(f->name, L->name)) return 0;
+  L->loaded++;
+  // The edge labels were picked for L->id_mode while parsing; enforcing them
+  // against a program instrumented in another mode flags every event
+  if (f->id_mode >= 0 && f->id_mode != L->id_mode) {
+    static const char *const fix[] = {"drop --unique/--global", "pass --unique", "pass --global"};
+    fprintf(stderr, "Function %u was built with idMode %s but is loaded as %s (%s)\n", f->index,
+            mode_names[f->id_mode], mode_names[L->id_mode], fix[f->id_mode]);
+    return 1;
+  }
+  if (global && !f->has_key) {
+    fprintf(stderr, "No funcKey for function %u (policy built without global IDs?)\n", f->index);
+    return 1;
+  }
+
+  if (L->checkpoints) {
+    if (!f->has_checkpoints) {
+      fprintf(stderr, "No checkpoints for function %u (policy built without -libcall-checkpoints?)\n", f->index);
+      return 1;
     }
-    if (field && field < ee && find_value(field, (id_mode==0)?"matchDummy":"matchUnique", buf, sizeof(buf)) == 0) {
-      edges[idx].match_id = atoi(buf);
+    if (f->num_checkpoints == 0) {
+      report("Function %u has no checkpoints; nothing to load\n", f->index);
     } else {
-      edges[idx].match_id = -1;
+      if (send_checkpoints(L->fd, L->pid, f->num_checkpoints, global, f->func_key, f->rows) != 0)
+        return 1;
+      report("Loaded checkpoints: pid=%d function=%u checkpoints=%u%s\n",
+             L->pid, f->index, f->num_checkpoints, global ? " (global)" : "");
     }
-    idx++;
-    cur = ee + 1;
+    return L->name ? JSON_DONE : 0;
   }
 
-  *edges_out = (uint32_t*)edges;
-  *num_edges_out = edges_count;
-  return 0;
+  if (send_automaton(L->fd, L->pid, L->id_mode, f->func_key, f->num_nodes, f->num_edges, f->edges) != 0)
+    return 1;
+  report("Loaded policy: pid=%d function=%u nodes=%u edges=%u mode=%s\n",
+         L->pid, f->index, f->num_nodes, f->num_edges, mode_names[L->id_mode]);
+  return L->name ? JSON_DONE : 0;
+}
+
+// Policy JSON from the pass or libcall-link, read in one pass over the
+// mapping. JSON has no index, so a function picked by name is found by
+// decoding entries until it turns up; LCPB images look it up directly.
+static int load_json(pid_t pid, const char *path, int func_index, const char *func_name,
+                     int all_functions, int id_mode, int checkpoints)
+{
+  size_t size, err_offset = 0;
+  char *m = map_file(path, &size);
+  if (!m) { fprintf(stderr, "%s: %s\n", path, strerror(errno)); return 1; }
+
+  struct json_load L = { .pid = pid, .id_mode = id_mode, .checkpoints = checkpoints,
+                         .name = all_functions ? NULL : func_name };
+  L.fd = open_device();
+  if (L.fd < 0) { munmap(m, size); return 1; }
+
+  int want = all_functions || L.name ? -1 : func_index;
+  int rc = parse_policy_json(m, size, id_mode, want, load_json_function, &L, &err_offset);
+  if (rc == JSON_DONE) rc = 0;
+  if (rc < 0) {
+    fprintf(stderr, "%s: malformed policy JSON at byte %zu\n", path, err_offset);
+  } else if (rc == 0 && !all_functions && L.loaded == 0) {
+    if (L.name) fprintf(stderr, "%s: no function named %s\n", path, L.name);
+    else fprintf(stderr, "%s: no function %d\n", path, func_index);
+    rc = -1;
+  }
+
+  close(L.fd);
+  munmap(m, size);
+  return rc ? 1 : 0;
 }
 
 static void usage(const char *argv0) {
-  fprintf(stderr, "Usage: %s -p <pid> -j <policy.json> [-f <function-index>] [--unique]\n", argv0);
+  fprintf(stderr, "Usage: %s -p <pid> -j <policy.json> [-f <index>|<name>|all] [--unique|--global] [--checkpoints]\n", argv0);
+  fprintf(stderr, "       %s -p <pid> -b <policy.lcpb> [-f <index>|<name>|all] [--checkpoints]\n", argv0);
+  fprintf(stderr, "       %s -p <pid> -e <executable> [-f <index>|<name>|all] [--checkpoints]\n", argv0);
+  fprintf(stderr, "       %s compile <policy.json> [-o <policy.lcpb>] (see %s compile -h)\n", argv0, argv0);
+  fprintf(stderr, "       %s daemon -r <registry> (see %s daemon -h)\n", argv0, argv0);
+  fprintf(stderr, "       %s stats [-p <pid>] | top [-d <seconds>]\n", argv0);
+  fprintf(stderr, "       %s bench -j <policy.json> [options] (see %s bench -h)\n", argv0, argv0);
+  fprintf(stderr, "       %s exec [-j <policy.json>|-b <policy.lcpb>|-e <executable>] [options] -- <command> [args...]\n", argv0);
   fprintf(stderr, "Loads the function's automaton into the kernel sandbox for the given PID.\n");
+  fprintf(stderr, "Instead of one -p <pid>, targets may be -p <pid>,<pid>,..., --pgid <pgid>, --sid <sid>,\n"
+                  "--tgid <pid> (all its threads) or --exe <path> (every process running it), and --threads\n"
+                  "adds the threads of each; the policy is parsed once and attached in one ioctl.\n");
+  fprintf(stderr, "-f picks the function by position or by name (default 0).\n");
+  fprintf(stderr, "With --global (policy built with -libcall-id-mode=global), -f all loads every function.\n");
+  fprintf(stderr, "-b loads a program policy from libcall-link -b; the image records its ID mode.\n");
+  fprintf(stderr, "-e loads the policies embedded in an executable built with -libcall-embed.\n");
+  fprintf(stderr, "--checkpoints loads the checkpoint relation of a -libcall-checkpoints policy instead of the NFA.\n");
+  fprintf(stderr, "--compiled loads -j through the compile cache (minimal DFAs where no larger).\n");
+  fprintf(stderr, "exec runs the command with the policy loaded before its first instruction and exits with\n"
+                  "its status; without -j/-b/-e it loads the policy embedded in the command.\n");
 }
 
-int main(int argc, char **argv)
+static int load_images(pid_t pid, const struct image *imgs, size_t n, int func_index,
+                       const char *func_name, int all_functions, int checkpoints)
 {
-  int opt;
-  pid_t pid = -1;
-  const char *json_path = NULL;
-  int func_index = 0;
-  int id_mode = 0; // 0=dummy, 1=unique
-
-  for (int i=1; i<argc; ++i) {
-    if (!strcmp(argv[i], "-p") && i+1<argc) { pid = (pid_t)atoi(argv[++i]); }
-    else if (!strcmp(argv[i], "-j") && i+1<argc) { json_path = argv[++i]; }
-    else if (!strcmp(argv[i], "-f") && i+1<argc) { func_index = atoi(argv[++i]); }
-    else if (!strcmp(argv[i], "--unique")) { id_mode = 1; }
-    else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) { usage(argv[0]); return 1; }
+  size_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (imgs[i].h->id_mode != imgs[0].h->id_mode) {
+      fprintf(stderr, "Embedded policies use different ID modes\n");
+      return -1;
+    }
+    total += imgs[i].h->num_functions;
+  }
+  if (n == 0) {
+    fprintf(stderr, "No policy images found\n");
+    return -1;
+  }
+  if (all_functions && imgs[0].h->id_mode != LCPB_ID_GLOBAL) {
+    fprintf(stderr, "-f all needs a policy built with global IDs: other modes hold one automaton per process\n");
+    return -1;
   }
 
-  if (pid <= 0 || !json_path) { usage(argv[0]); return 1; }
+  // One function: by name through each image's index (the first image that
+  // has it wins, as with -f all), by position by skipping whole images
+  if (!all_functions) {
+    size_t img = 0, f;
+    if (func_name) {
+      long found = -1;
+      while (img < n && (found = lcpb_find(imgs[img].h, func_name)) < 0) ++img;
+      if (found < 0) {
+        fprintf(stderr, "No function named %s\n", func_name);
+        return -1;
+      }
+      f = (size_t)found;
+    } else {
+      if (func_index < 0 || (size_t)func_index >= total) {
+        fprintf(stderr, "Function %d out of range (%zu functions)\n", func_index, total);
+        return -1;
+      }
+      for (f = (size_t)func_index; f >= imgs[img].h->num_functions; ++img)
+        f -= imgs[img].h->num_functions;
+    }
+    int fd = open_device();
+    if (fd < 0) return -1;
+    int rc = load_binary_function(fd, imgs[img].h, imgs[img].size, pid, (uint32_t)f, checkpoints);
+    close(fd);
+    return rc;
+  }
 
-  size_t jlen;
-  char *json = slurp(json_path, &jlen);
-  if (!json) { perror("read json"); return 1; }
+  size_t cap = 16;
+  while (cap < 2 * total) cap *= 2;
+  uint32_t *keys = calloc(cap, sizeof(uint32_t));
+  uint8_t *used = calloc(cap, 1);
+  int fd = keys && used ? open_device() : -1;
+  if (fd < 0) {
+    if (!keys || !used) perror("calloc");
+    free(keys);
+    free(used);
+    return -1;
+  }
 
-  uint32_t *edges_raw = NULL;
-  uint32_t num_edges = 0, num_nodes = 0;
-  if (extract_graph_edges(json, func_index, id_mode, &edges_raw, &num_edges, &num_nodes) != 0) {
-    fprintf(stderr, "Failed to parse edges from JSON (func_index=%d)\n", func_index);
-    free(json);
-    return 1;
+  int rc = 0;
+  for (size_t i = 0; i < n && rc == 0; ++i) {
+    const struct lcpb_header *h = imgs[i].h;
+    const struct lcpb_function *fns = (const struct lcpb_function*)((const char*)h + h->functions_offset);
+    for (uint32_t f = 0; f < h->num_functions && rc == 0; ++f) {
+      if (key_seen(keys, used, cap, fns[f].func_key)) continue;
+      rc = load_binary_function(fd, h, imgs[i].size, pid, f, checkpoints);
+    }
   }
-  free(json);
+  close(fd);
+  free(keys);
+  free(used);
+  return rc;
+}
 
-  int fd = open(DEVICE_PATH, O_RDWR);
-  if (fd < 0) { perror("open /dev/libcallsandbox"); free(edges_raw); return 1; }
+// Load from an LCPB image (libcall-link -b), or with `embedded` from the
+// .libcall_policy section of an executable built with -libcall-embed
+static int load_binary(pid_t pid, const char *path, int func_index, const char *func_name,
+                       int all_functions, int checkpoints, int embedded)
+{
+  size_t size, n = 0;
+  char *m = map_file(path, &size);
+  if (!m) { fprintf(stderr, "%s: %s\n", path, strerror(errno)); return 1; }
 
-  struct policy_blob hdr = {
-    .pid = (uint32_t)pid,
-    .num_nodes = num_nodes,
-    .num_edges = num_edges,
-    .id_mode = (uint32_t)id_mode
-  };
+  struct image *imgs = NULL;
+  if (embedded) {
+    size_t sec_size;
+    const char *sec = find_policy_section(m, size, &sec_size);
+    if (!sec)
+      fprintf(stderr, "%s: no .libcall_policy section (built without -libcall-embed?)\n", path);
+    else if (!(imgs = split_images(sec, sec_size, &n)))
+      fprintf(stderr, "%s: malformed .libcall_policy section\n", path);
+  } else if (lcpb_valid((const struct lcpb_header*)m, size) && (imgs = malloc(sizeof(*imgs)))) {
+    const struct lcpb_header *h = (const struct lcpb_header*)m;
+    imgs[0] = (struct image){ h, (size_t)h->total_size };
+    n = 1;
+  } else if (size >= 8 && !memcmp(m, LCPB_MAGIC, 4) && ((const struct lcpb_header*)m)->version != LCPB_VERSION) {
+    fprintf(stderr, "%s: LCPB version %u, expected %u (relink with this libcall-link)\n", path,
+            ((const struct lcpb_header*)m)->version, LCPB_VERSION);
+  } else {
+    fprintf(stderr, "%s: not a valid LCPB image\n", path);
+  }
 
-  size_t blob_sz = sizeof(hdr) + num_edges * sizeof(struct edge);
-  void *blob = malloc(blob_sz);
-  if (!blob) { perror("malloc"); free(edges_raw); close(fd); return 1; }
-  memcpy(blob, &hdr, sizeof(hdr));
-  memcpy((char*)blob + sizeof(hdr), edges_raw, num_edges * sizeof(struct edge));
+  int rc = imgs ? load_images(pid, imgs, n, func_index, func_name, all_functions, checkpoints) : -1;
+  free(imgs);
+  munmap(m, size);
+  return rc ? 1 : 0;
+}
 
-  if (ioctl(fd, IOCTL_LOAD_POLICY, blob) != 0) {
-    perror("ioctl load policy");
-    free(edges_raw);
-    free(blob);
-    close(fd);
+int load_policy(pid_t pid, const struct policy_source *src)
+{
+  if (src->binary_path || src->exe_path)
+    return load_binary(pid, src->binary_path ? src->binary_path : src->exe_path, src->func_index,
+                       src->func_name, src->all_functions, src->checkpoints, src->exe_path != NULL);
+  if (src->all_functions && src->id_mode != ID_MODE_GLOBAL) {
+    fprintf(stderr, "-f all needs --global: other modes hold one automaton per process\n");
     return 1;
   }
+  if (src->compiled) return load_compiled(pid, src);
+  return load_json(pid, src->json_path, src->func_index, src->func_name, src->all_functions,
+                   src->id_mode, src->checkpoints);
+}
 
-  printf("Loaded policy: pid=%d nodes=%u edges=%u mode=%s\n",
-         pid, num_nodes, num_edges, id_mode?"unique":"dummy");
+int record_policy(const struct policy_source *src, struct policy_recording *rec)
+{
+  *rec = (struct policy_recording){ 0 };
+  recording = rec;
+  int rc = load_policy(0, src);
+  recording = NULL;
+  if (rc) free_recording(rec);
+  return rc;
+}
 
-  free(edges_raw);
-  free(blob);
-  close(fd);
+int replay_policy(int fd, pid_t pid, const struct policy_recording *rec)
+{
+  for (size_t i = 0; i < rec->count; ++i) {
+    *(uint32_t*)rec->calls[i].blob = (uint32_t)pid;
+    if (ioctl(fd, rec->calls[i].cmd, rec->calls[i].blob) != 0) return -1;
+  }
   return 0;
 }
+
+void free_recording(struct policy_recording *rec)
+{
+  for (size_t i = 0; i < rec->count; ++i) free(rec->calls[i].blob);
+  free(rec->calls);
+  *rec = (struct policy_recording){ 0 };
+}
+
+int parse_source_option(int argc, char **argv, int *i, struct policy_source *src)
+{
+  const char *arg = argv[*i];
+  int has_value = *i + 1 < argc;
+  if (!strcmp(arg, "-j") && has_value) src->json_path = argv[++*i];
+  else if (!strcmp(arg, "-b") && has_value) src->binary_path = argv[++*i];
+  else if (!strcmp(arg, "-e") && has_value) src->exe_path = argv[++*i];
+  else if (!strcmp(arg, "-f") && has_value) {
+    arg = argv[++*i];
+    if (!strcmp(arg, "all")) src->all_functions = 1;
+    else if (arg[0] && !arg[strspn(arg, "0123456789")]) src->func_index = atoi(arg);
+    else src->func_name = arg;
+  }
+  else if (!strcmp(arg, "--unique")) src->id_mode = ID_MODE_UNIQUE;
+  else if (!strcmp(arg, "--global")) src->id_mode = ID_MODE_GLOBAL;
+  else if (!strcmp(arg, "--checkpoints")) src->checkpoints = 1;
+  else if (!strcmp(arg, "--compiled")) src->compiled = 1;
+  else return 0;
+  return 1;
+}
+
+// The file execvp() would run for `name`
+static const char *find_command(const char *name, char *buf, size_t size)
+{
+  if (strchr(name, '/')) return name;
+  const char *path = getenv("PATH");
+  for (const char *p = path ? path : "/usr/local/bin:/usr/bin:/bin"; ; ++p) {
+    size_t len = strcspn(p, ":");
+    if ((size_t)snprintf(buf, size, "%.*s%s%s", (int)len, p, len ? "/" : "", name) < size &&
+        access(buf, X_OK) == 0)
+      return buf;
+    p += len;
+    if (!*p) return NULL;
+  }
+}
+
+// Run `cmd` as a child that waits on a pipe until its policy is loaded, so
+// it is enforced from the first instruction after execvp(). Exits with the
+// command's status, or 128 + signal like a shell.
+static int exec_sandboxed(char **cmd, const struct policy_source *src)
+{
+  int go[2];
+  if (pipe2(go, O_CLOEXEC) != 0) { perror("pipe"); return 1; }
+  fflush(NULL);
+  pid_t child = fork();
+  if (child < 0) { perror("fork"); return 1; }
+  if (child == 0) {
+    char c = 0;
+    close(go[1]);
+    // EOF instead of the go byte: the loader failed or died
+    while (read(go[0], &c, 1) < 0 && errno == EINTR) ;
+    if (c != 'g') _exit(127);
+    execvp(cmd[0], cmd);
+    fprintf(stderr, "%s: %s\n", cmd[0], strerror(errno));
+    _exit(127);
+  }
+
+  close(go[0]);
+  int rc = load_policy(child, src);
+  fflush(stdout);
+  if (rc == 0 && write(go[1], "g", 1) != 1) { perror("write"); rc = 1; }
+  close(go[1]);
+
+  int status;
+  while (waitpid(child, &status, 0) < 0) {
+    if (errno != EINTR) { perror("waitpid"); return 1; }
+  }
+  if (rc) return 1;
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "%s: killed by signal %d%s\n", cmd[0], WTERMSIG(status),
+            WTERMSIG(status) == SIGKILL ? " (policy violation?)" : "");
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv)
+{
+  struct target_set targets = { 0 };
+  struct policy_source src = { .id_mode = ID_MODE_DUMMY };
+  if (argc > 1 && !strcmp(argv[1], "daemon")) return daemon_main(argc - 1, argv + 1);
+  if (argc > 1 && !strcmp(argv[1], "compile")) return compile_main(argc - 1, argv + 1);
+  if (argc > 1 && !strcmp(argv[1], "stats")) return stats_main(argc - 1, argv + 1);
+  if (argc > 1 && !strcmp(argv[1], "top")) return top_main(argc - 1, argv + 1);
+  if (argc > 1 && !strcmp(argv[1], "bench")) return bench_main(argc - 1, argv + 1);
+  int exec_mode = argc > 1 && !strcmp(argv[1], "exec");
+  char **cmd = NULL;
+  int rc;
+
+  for (int i = 1 + exec_mode; i<argc; ++i) {
+    if (exec_mode && !strcmp(argv[i], "--")) { cmd = argv + i + 1; break; }
+    else if (!exec_mode && (rc = parse_target_option(argc, argv, &i, &targets))) { if (rc < 0) return 1; }
+    else if (parse_source_option(argc, argv, &i, &src)) { }
+    else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) { usage(argv[0]); return 1; }
+  }
+
+  int sources = !!src.json_path + !!src.binary_path + !!src.exe_path;
+  if (exec_mode) {
+    char path[4096];
+    if (!cmd || !cmd[0] || sources > 1) { usage(argv[0]); return 1; }
+    if (!sources && !(src.exe_path = find_command(cmd[0], path, sizeof(path)))) {
+      fprintf(stderr, "%s: command not found\n", cmd[0]);
+      return 127;
+    }
+    return exec_sandboxed(cmd, &src);
+  }
+
+  if (!targets.count && !targets.pgid && !targets.sid && !targets.tgid && !targets.exe) { usage(argv[0]); return 1; }
+  if (sources != 1) { usage(argv[0]); return 1; }
+  rc = target_is_single(&targets) ? load_policy(targets.pids[0], &src) : attach_targets(&targets, &src);
+  free_targets(&targets);
+  return rc;
+}
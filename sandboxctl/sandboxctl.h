@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: MIT
+// Loader entry points shared by the sandboxctl subcommands.
+#ifndef SANDBOXCTL_H
+#define SANDBOXCTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#define DEVICE_PATH "/dev/libcallsandbox"
+#define IOCTL_MAGIC 'L'
+
+#define ID_MODE_DUMMY  0
+#define ID_MODE_UNIQUE 1
+#define ID_MODE_GLOBAL 2
+
+// Load ioctls; each blob is followed by its edges (struct lcpb_edge) or rows
+#define IOCTL_LOAD_POLICY _IOW(IOCTL_MAGIC, 0x01, void*)
+#define IOCTL_LOAD_FUNC_POLICY _IOW(IOCTL_MAGIC, 0x02, void*)
+#define IOCTL_LOAD_CHECKPOINTS _IOW(IOCTL_MAGIC, 0x03, void*)
+
+struct policy_blob {
+  uint32_t pid;
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t id_mode; // 0=dummy 1=unique
+};
+
+// Global IDs: one function of the program, keyed by its "funcKey"
+struct policy_blob_v2 {
+  uint32_t pid;
+  uint32_t num_nodes;
+  uint32_t num_edges;
+  uint32_t id_mode; // 2=global
+  uint32_t func_key;
+  uint32_t reserved;
+};
+
+// Checkpoint policy: (num_checkpoints + 1) rows of u64 words follow, row 0 the
+// start set and row i the checkpoints allowed after checkpoint i
+#define CHECKPOINT_GLOBAL 0x1
+struct checkpoint_blob {
+  uint32_t pid;
+  uint32_t num_checkpoints;
+  uint32_t func_key;
+  uint32_t flags;
+};
+
+// IOCTL_GET_STATS: one pid_stats per pid with a policy
+#define IOCTL_GET_STATS _IOWR(IOCTL_MAGIC, 0x04, void*)
+
+// Engines a pid's automata use (pid_stats.engines)
+#define ENGINE_NFA        0x1
+#define ENGINE_CHECKPOINT 0x2
+
+#define LAT_BUCKETS 128
+
+struct pid_stats {
+  uint32_t pid;
+  uint32_t id_mode;
+  uint32_t num_funcs;
+  uint32_t engines;   // ENGINE_*
+  uint64_t loaded_ns;
+  uint64_t events;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t violations;
+  uint64_t frontier;  // active NFA states; a checkpoint policy counts 1
+  uint64_t mem_bytes; // kernel memory held by the policy
+  uint64_t lat_hist[LAT_BUCKETS]; // log-linear latency histogram
+};
+
+struct stats_query {
+  uint32_t max_entries; // capacity of the array that follows
+  uint32_t num_entries; // out: entries written
+  uint32_t total;       // out: pids with a policy; retry with more room if larger
+  uint32_t timing;      // out: whether latencies are measured
+  uint64_t now_ns;      // out: CLOCK_MONOTONIC at the snapshot
+  // Followed by max_entries * struct pid_stats
+};
+
+// IOCTL_ATTACH_MANY: the given load ioctls, for each of num_pids pids
+#define IOCTL_ATTACH_MANY _IOWR(IOCTL_MAGIC, 0x05, void*)
+#define MAX_ATTACH_PIDS (1u << 16)
+
+struct attach_call {
+  uint32_t cmd;       // IOCTL_LOAD_POLICY, IOCTL_LOAD_FUNC_POLICY or IOCTL_LOAD_CHECKPOINTS
+  uint32_t reserved;
+  uint64_t blob;      // that ioctl's argument; its pid is ignored
+};
+
+struct attach_many {
+  uint32_t num_pids;
+  uint32_t num_calls;
+  uint64_t pids;      // uint32_t[num_pids]
+  uint64_t calls;     // struct attach_call[num_calls]
+  uint32_t attached;  // out: pids that got every call
+  uint32_t skipped;   // out: pids that exited first
+};
+
+// IOCTL_DETACH: drop the policy of the pid pointed to (a uint32_t)
+#define IOCTL_DETACH _IOW(IOCTL_MAGIC, 0x06, void*)
+
+// Where a policy comes from and which of its functions to load
+struct policy_source {
+  const char *json_path;
+  const char *binary_path;
+  const char *exe_path;
+  int func_index;
+  const char *func_name;
+  int all_functions;
+  int id_mode;
+  int checkpoints;
+  int compiled;        // -j through `sandboxctl compile` and its cache
+};
+
+// Consume the policy option at argv[*i] (-j -b -e -f --unique --global
+// --checkpoints --compiled), advancing *i past its argument. Returns 0 if
+// argv[*i] is not one of them.
+int parse_source_option(int argc, char **argv, int *i, struct policy_source *src);
+
+// Load `src` for `pid`, printing what was loaded. Returns 0 on success.
+int load_policy(pid_t pid, const struct policy_source *src);
+
+// The ioctls a load issues, kept to be replayed for other pids. Every blob
+// starts with the target pid.
+struct policy_recording {
+  size_t count;
+  struct recorded_ioctl {
+    unsigned long cmd;
+    size_t size;
+    void *blob;
+  } *calls;
+};
+
+// Run a load of `src` into `rec` instead of the kernel. Returns 0 on success.
+int record_policy(const struct policy_source *src, struct policy_recording *rec);
+// Issue the recorded ioctls on `fd` for `pid`
+int replay_policy(int fd, pid_t pid, const struct policy_recording *rec);
+void free_recording(struct policy_recording *rec);
+
+// Processes to attach a policy to: explicit pids plus every process a
+// selector matches (0 / NULL when unused)
+struct target_set {
+  pid_t *pids;
+  size_t count, cap;
+  pid_t pgid;
+  pid_t sid;
+  pid_t tgid;          // this process and all its threads
+  const char *exe;     // every process running this file
+  int threads;         // add all threads of every selected process
+};
+
+// Consume the target option at argv[*i] (-p --pgid --sid --tgid --exe
+// --threads). Returns 1 if consumed, 0 if argv[*i] is not one of them, -1
+// on a bad value.
+int parse_target_option(int argc, char **argv, int *i, struct target_set *t);
+// Whether `t` is a single -p pid
+int target_is_single(const struct target_set *t);
+// Resolve `t` and attach `src` to all of it with one policy parse. Returns 0
+// if every process got the policy.
+int attach_targets(struct target_set *t, const struct policy_source *src);
+void free_targets(struct target_set *t);
+
+// Compile src->json_path (cached) and load the resulting image
+int load_compiled(pid_t pid, const struct policy_source *src);
+
+int daemon_main(int argc, char **argv);
+int compile_main(int argc, char **argv);
+int stats_main(int argc, char **argv);
+int top_main(int argc, char **argv);
+int bench_main(int argc, char **argv);
+
+#endif
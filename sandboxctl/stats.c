@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: MIT
+// sandboxctl stats / top: per-pid enforcement cost from the module's counters.
+//
+// The module keeps, per pid, an event count, the time spent stepping its
+// automata and a log-linear latency histogram (IOCTL_GET_STATS). `stats`
+// prints rates since each policy was loaded; `top` redraws rates over the
+// last interval. Both sort by enforcement CPU time, the most costly first.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "sandboxctl.h"
+
+// Snapshot every pid's counters. Returns a malloc'd query followed by its
+// entries, or NULL.
+static struct stats_query *query_stats(int fd)
+{
+  size_t cap = 64;
+  for (;;) {
+    struct stats_query *q = calloc(1, sizeof(*q) + cap * sizeof(struct pid_stats));
+    if (!q) { perror("calloc"); return NULL; }
+    q->max_entries = (uint32_t)cap;
+    if (ioctl(fd, IOCTL_GET_STATS, q) != 0) {
+      perror(errno == ENOTTY ? "ioctl get stats (module too old?)" : "ioctl get stats");
+      free(q);
+      return NULL;
+    }
+    if (q->total <= q->num_entries || q->num_entries < cap) return q;
+    cap = q->total + 16; // policies were added since the last try
+    free(q);
+  }
+}
+
+static const struct pid_stats *entries(const struct stats_query *q)
+{
+  return (const struct pid_stats*)(q + 1);
+}
+
+// Upper bound in ns of latency bucket `b` (the module's lat_bucket())
+static uint64_t bucket_high(uint32_t b)
+{
+  if (b < 4) return b;
+  uint32_t o = b / 4 + 1;
+  return ((uint64_t)(4 + b % 4 + 1) << (o - 2)) - 1;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t count, double p)
+{
+  uint64_t rank = (uint64_t)(p * (double)count + 0.999999), seen = 0;
+  if (!count) return 0;
+  for (uint32_t b = 0; b < LAT_BUCKETS; ++b)
+    if ((seen += hist[b]) >= rank) return bucket_high(b);
+  return bucket_high(LAT_BUCKETS - 1);
+}
+
+// One display line: rates over some interval
+struct row {
+  const struct pid_stats *s;
+  double events_per_sec;
+  double cpu;       // fraction of a CPU spent enforcing
+  uint64_t avg_ns, p99_ns;
+};
+
+static void make_row(struct row *r, const struct pid_stats *s, const struct pid_stats *prev, uint64_t ns)
+{
+  uint64_t hist[LAT_BUCKETS], events = s->events, total = s->total_ns;
+  memcpy(hist, s->lat_hist, sizeof(hist));
+  if (prev) {
+    events -= prev->events;
+    total -= prev->total_ns;
+    for (uint32_t b = 0; b < LAT_BUCKETS; ++b) hist[b] -= prev->lat_hist[b];
+  }
+  uint64_t timed = 0;
+  for (uint32_t b = 0; b < LAT_BUCKETS; ++b) timed += hist[b];
+  r->s = s;
+  r->events_per_sec = ns ? (double)events * 1e9 / (double)ns : 0;
+  r->cpu = ns ? (double)total / (double)ns : 0;
+  r->avg_ns = timed ? total / timed : 0;
+  r->p99_ns = percentile(hist, timed, 0.99);
+}
+
+static int cmp_cost(const void *a, const void *b)
+{
+  const struct row *x = a, *y = b;
+  if (x->cpu != y->cpu) return x->cpu > y->cpu ? -1 : 1;
+  if (x->events_per_sec != y->events_per_sec) return x->events_per_sec > y->events_per_sec ? -1 : 1;
+  return x->s->pid < y->s->pid ? -1 : x->s->pid > y->s->pid;
+}
+
+static void format_ns(char *buf, size_t n, uint64_t ns, int timing)
+{
+  if (!timing) snprintf(buf, n, "-");
+  else if (ns < 1000) snprintf(buf, n, "%lluns", (unsigned long long)ns);
+  else if (ns < 1000000) snprintf(buf, n, "%.1fus", ns / 1e3);
+  else snprintf(buf, n, "%.1fms", ns / 1e6);
+}
+
+static void format_bytes(char *buf, size_t n, uint64_t bytes)
+{
+  if (bytes < 1024) snprintf(buf, n, "%lluB", (unsigned long long)bytes);
+  else if (bytes < 1024 * 1024) snprintf(buf, n, "%.1fK", bytes / 1024.0);
+  else snprintf(buf, n, "%.1fM", bytes / (1024.0 * 1024));
+}
+
+static void process_name(uint32_t pid, char *buf, size_t n)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%u/comm", pid);
+  FILE *f = fopen(path, "r");
+  if (!f || !fgets(buf, (int)n, f)) snprintf(buf, n, "(exited)");
+  else buf[strcspn(buf, "\n")] = 0;
+  if (f) fclose(f);
+}
+
+static const char *mode_name(uint32_t mode)
+{
+  static const char *const names[] = {"dummy", "unique", "global", "checkpoint"};
+  return mode < 4 ? names[mode] : "?";
+}
+
+static const char *engine_name(uint32_t engines)
+{
+  if (engines == (ENGINE_NFA | ENGINE_CHECKPOINT)) return "nfa+ckpt";
+  if (engines == ENGINE_CHECKPOINT) return "ckpt";
+  return engines ? "nfa" : "-";
+}
+
+static void print_rows(struct row *rows, size_t n, size_t limit, int timing)
+{
+  qsort(rows, n, sizeof(*rows), cmp_cost);
+  printf("%7s %-15s %-10s %-8s %6s %10s %8s %8s %8s %6s %8s %8s %4s\n", "PID", "COMMAND", "MODE", "ENGINE",
+         "FUNCS", "EVENTS/S", "AVG", "P99", "MAX", "CPU%", "FRONTIER", "KMEM", "KILL");
+  for (size_t i = 0; i < n && (!limit || i < limit); ++i) {
+    const struct row *r = &rows[i];
+    const struct pid_stats *s = r->s;
+    char comm[32], avg[16], p99[16], max[16], mem[16], cpu[16];
+    process_name(s->pid, comm, sizeof(comm));
+    format_ns(avg, sizeof(avg), r->avg_ns, timing);
+    format_ns(p99, sizeof(p99), r->p99_ns, timing);
+    format_ns(max, sizeof(max), s->max_ns, timing);
+    format_bytes(mem, sizeof(mem), s->mem_bytes);
+    if (timing) snprintf(cpu, sizeof(cpu), "%.2f", r->cpu * 100);
+    else snprintf(cpu, sizeof(cpu), "-");
+    printf("%7u %-15.15s %-10s %-8s %6u %10.0f %8s %8s %8s %6s %8llu %8s %4llu\n", s->pid, comm,
+           mode_name(s->id_mode), engine_name(s->engines), s->num_funcs, r->events_per_sec, avg, p99, max, cpu,
+           (unsigned long long)s->frontier, mem, (unsigned long long)s->violations);
+  }
+}
+
+static int open_device(void)
+{
+  int fd = open(DEVICE_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) perror("open " DEVICE_PATH);
+  return fd;
+}
+
+static void stats_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-p <pid>] [-n <rows>]\n", argv0);
+  fprintf(stderr, "Per-pid enforcement cost since each policy was loaded, most CPU first.\n");
+}
+
+int stats_main(int argc, char **argv)
+{
+  long only = -1, limit = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-p") && i + 1 < argc) only = strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc) limit = strtol(argv[++i], NULL, 10);
+    else { stats_usage(argv[0]); return 1; }
+  }
+
+  int fd = open_device();
+  if (fd < 0) return 1;
+  struct stats_query *q = query_stats(fd);
+  close(fd);
+  if (!q) return 1;
+
+  struct row *rows = calloc(q->num_entries + 1, sizeof(*rows));
+  size_t n = 0;
+  if (!rows) { perror("calloc"); free(q); return 1; }
+  for (uint32_t i = 0; i < q->num_entries; ++i) {
+    const struct pid_stats *s = &entries(q)[i];
+    if (only >= 0 && s->pid != (uint32_t)only) continue;
+    make_row(&rows[n++], s, NULL, q->now_ns - s->loaded_ns);
+  }
+  if (only >= 0 && !n) fprintf(stderr, "pid %ld has no policy\n", only);
+  else print_rows(rows, n, (size_t)limit, q->timing);
+  free(rows);
+  free(q);
+  return only >= 0 && !n;
+}
+
+static void top_usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-d <seconds>] [-n <rows>] [-i <iterations>]\n", argv0);
+  fprintf(stderr, "Redraws per-pid enforcement cost over each interval, most CPU first.\n");
+}
+
+// The entry for the same policy in the previous snapshot, if any
+static const struct pid_stats *previous(const struct stats_query *prev, const struct pid_stats *s)
+{
+  for (uint32_t i = 0; prev && i < prev->num_entries; ++i) {
+    const struct pid_stats *p = &entries(prev)[i];
+    if (p->pid == s->pid && p->loaded_ns == s->loaded_ns) return p;
+  }
+  return NULL;
+}
+
+int top_main(int argc, char **argv)
+{
+  double delay = 1;
+  long limit = 0, iterations = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-d") && i + 1 < argc) delay = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "-n") && i + 1 < argc) limit = strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-i") && i + 1 < argc) iterations = strtol(argv[++i], NULL, 10);
+    else { top_usage(argv[0]); return 1; }
+  }
+  if (delay <= 0) delay = 1;
+
+  int fd = open_device();
+  if (fd < 0) return 1;
+  int tty = isatty(STDOUT_FILENO);
+  struct stats_query *prev = query_stats(fd);
+  if (!prev) { close(fd); return 1; }
+
+  for (long it = 0; !iterations || it < iterations; ++it) {
+    usleep((useconds_t)(delay * 1e6));
+    struct stats_query *q = query_stats(fd);
+    if (!q) break;
+    struct row *rows = calloc(q->num_entries + 1, sizeof(*rows));
+    if (!rows) { perror("calloc"); free(q); break; }
+    for (uint32_t i = 0; i < q->num_entries; ++i) {
+      const struct pid_stats *s = &entries(q)[i];
+      const struct pid_stats *p = previous(prev, s);
+      // A policy loaded during the interval counts from its load
+      make_row(&rows[i], s, p, p ? q->now_ns - prev->now_ns : q->now_ns - s->loaded_ns);
+    }
+
+    if (tty) printf("\033[H\033[2J");
+    double cpu = 0, events = 0;
+    for (uint32_t i = 0; i < q->num_entries; ++i) {
+      cpu += rows[i].cpu;
+      events += rows[i].events_per_sec;
+    }
+    printf("sandboxctl top: %u pids, %.0f events/s", q->total, events);
+    if (q->timing) printf(", %.2f%% CPU enforcing", cpu * 100);
+    else printf(", latency timing off (timing=0)");
+    printf(", every %gs\n\n", delay);
+    print_rows(rows, q->num_entries, (size_t)limit, q->timing);
+    if (!tty) printf("\n");
+    fflush(stdout);
+    free(rows);
+    free(prev);
+    prev = q;
+  }
+  free(prev);
+  close(fd);
+  return 0;
+}